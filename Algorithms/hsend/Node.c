@@ -1,45 +1,101 @@
 #include "contiki.h"
 
-#include "core/lib/list.h"
+#include "lib/random.h"
+
+#include "dev/sht11-sensor.h"
 
 #include "net/rime.h"
 #include "net/rime/mesh.h"
 #include "net/rime/stbroadcast.h"
-#include ""
+#include "net/rime/runicast.h"
 
 #include <stdio.h>
 #include <string.h>
 
 #include "debug-helper.h"
+#include "seen-cache.h"
 
 static struct mesh_conn mesh;
 static struct stbroadcast_conn stbroadcast;
+static struct runicast_conn runicast;
 
 static rimeaddr_t baseStationAddr;
 
 static uint8_t message_id = 10;
-static uint8_t message_id_received;
+
+// The longest predicate that can be sent with a request
+#define PREDICATE_MAX_LENGTH 32
+
+// The most nodes' data that can be gathered in one round. A full reply
+// is 4 + 11 * 8 bytes, which must fit in the 99 bytes of a CC2420
+// frame left after the lower layers' headers.
+#define MAX_GATHERED 11
+
+// How long each hop of the neighbourhood gets to reply, nodes
+// further from the originator reply first so their data can be
+// added to their parent's reply
+static const clock_time_t HOP_WAIT = 5 * CLOCK_SECOND;
+
+// How long a request keeps being rebroadcast by each node
+static const clock_time_t STUBBORN_DURATION = 3 * CLOCK_SECOND;
+
+static const int RUNICAST_MAX_RETX = 4;
 
 
 //Methods
 static void 
-send_n_hop_predicate_check(rimeaddr_t originator, uint8_t message_id, char* pred, uint8_t hop_limit);
-
-static list_t message_list;
+send_n_hop_predicate_check(rimeaddr_t const * originator, uint8_t message_id, char const * pred, uint8_t hop_limit, uint8_t hops);
 
-typedef struct 
+typedef struct
 {
+	rimeaddr_t originator;
+
+	// The node that sent us the request, replies go back to it
+	rimeaddr_t sender;
+
 	uint8_t message_id;
+
+	// How many more hops the request will travel
+	uint8_t hop_limit;
+
+	// How many hops the sender is from the originator
 	uint8_t hops;
-} message_elem_t;
 
+	// The predicate is sent in the packet rather than as a
+	// pointer, which would mean nothing on another node
+	char predicate_to_check[PREDICATE_MAX_LENGTH];
+} predicate_check_msg_t;
+
+typedef struct
+{
+	rimeaddr_t addr;
+	uint8_t hops;
+
+	// Raw SHT11 readings
+	uint16_t temperature;
+	uint16_t humidity;
+} gathered_data_t;
+
+/** A reply is followed by count gathered_data_t, one for the
+	node sending it and one for each node below it in the tree */
 typedef struct
 {
 	rimeaddr_t originator;
 	uint8_t message_id;
-	char* predicate_to_check;
-	uint8_t hop_limit;
-} predicate_check_msg_t;
+	uint8_t count;
+} gather_reply_msg_t;
+
+// The requests that have been seen, so they are not handled twice
+static seen_cache_t seen_cache;
+
+// The round of gathering this node is taking part in
+static bool gather_is_active = false;
+static rimeaddr_t gather_originator;
+static uint8_t gather_message_id;
+static rimeaddr_t gather_parent;
+static uint8_t gather_count;
+static gathered_data_t gathered[MAX_GATHERED];
+static struct ctimer gather_timer;
 
 bool is_base()
 {
@@ -50,19 +106,117 @@ bool is_base()
 	return rimeaddr_cmp(&rimeaddr_node_addr, &base) != 0;
 }
 
-/*static bool 
-list_is_elem(list_t * list)
+static uint8_t 
+get_message_id()
 {
-	while (list->next) 
+	return message_id++;
+}
+
+static void
+gather_add(gathered_data_t const * data)
+{
+	if (gather_count == MAX_GATHERED)
 	{
-		
+		printf("No space to gather data from %s\n", addr2str(&data->addr));
+		return;
 	}
-}*/
 
-static uint8_t 
-get_message_id()
+	gathered[gather_count++] = *data;
+}
+
+static void
+finish_gather(void * ptr)
 {
-	return message_id++;
+	if (rimeaddr_cmp(&gather_originator, &rimeaddr_node_addr))
+	{
+		printf("Gathered data from %u nodes:\n", gather_count);
+
+		uint8_t i;
+		for (i = 0; i != gather_count; ++i)
+		{
+			printf("Node:%s Hops:%u Temp:%u Humid:%u\n",
+				addr2str(&gathered[i].addr), gathered[i].hops,
+				gathered[i].temperature, gathered[i].humidity);
+		}
+
+		gather_is_active = false;
+		return;
+	}
+
+	// Only one reply can be sent at a time
+	if (runicast_is_transmitting(&runicast))
+	{
+		ctimer_set(&gather_timer, CLOCK_SECOND / 2, &finish_gather, NULL);
+		return;
+	}
+
+	// Send our data and everything gathered from
+	// below us back towards the originator
+	unsigned int length = sizeof(gather_reply_msg_t) + gather_count * sizeof(gathered_data_t);
+
+	packetbuf_clear();
+	packetbuf_set_datalen(length);
+	debug_packet_size(length);
+	gather_reply_msg_t * msg = (gather_reply_msg_t *)packetbuf_dataptr();
+	memset(msg, 0, length);
+
+	rimeaddr_copy(&msg->originator, &gather_originator);
+	msg->message_id = gather_message_id;
+	msg->count = gather_count;
+	memcpy(msg + 1, gathered, gather_count * sizeof(gathered_data_t));
+
+	runicast_send(&runicast, &gather_parent, RUNICAST_MAX_RETX);
+
+	gather_is_active = false;
+}
+
+/** Takes part in a round of gathering, replying after the nodes further
+	from the originator have had time to reply to us */
+static void
+start_gather(rimeaddr_t const * originator, uint8_t id, rimeaddr_t const * parent, uint8_t hops, uint8_t hop_limit)
+{
+	gather_is_active = true;
+	rimeaddr_copy(&gather_originator, originator);
+	gather_message_id = id;
+	rimeaddr_copy(&gather_parent, parent);
+	gather_count = 0;
+
+	gathered_data_t own;
+	rimeaddr_copy(&own.addr, &rimeaddr_node_addr);
+	own.hops = hops;
+
+	SENSORS_ACTIVATE(sht11_sensor);
+	own.temperature = sht11_sensor.value(SHT11_SENSOR_TEMP);
+	own.humidity = sht11_sensor.value(SHT11_SENSOR_HUMIDITY);
+	SENSORS_DEACTIVATE(sht11_sensor);
+
+	gather_add(&own);
+
+	// Siblings reply at slightly different times so they do not collide
+	clock_time_t wait = hop_limit * HOP_WAIT + random_rand() % CLOCK_SECOND;
+
+	ctimer_set(&gather_timer, wait, &finish_gather, NULL);
+}
+
+/** Floods a predicate out to hop_limit hops and gathers the data
+	of every node it reaches back to us in one round */
+static void
+n_hop_gather(char const * pred, uint8_t hop_limit)
+{
+	if (gather_is_active)
+	{
+		printf("Already gathering, not starting another\n");
+		return;
+	}
+
+	uint8_t id = get_message_id();
+
+	seen_cache_check_and_add(&seen_cache, &rimeaddr_node_addr, id);
+
+	// Wait for an extra hop so the furthest nodes' data has time to arrive
+	start_gather(&rimeaddr_node_addr, id, &rimeaddr_node_addr, 0, hop_limit + 1);
+
+	send_n_hop_predicate_check(&rimeaddr_node_addr, id, pred, hop_limit, 0);
 }
 
 /** The function that will be executed when a message is received */
@@ -106,31 +260,48 @@ mesh_timedout(struct mesh_conn *c)
 
 	}
 }
-	static uint8_t highest_hops_seen = 0;
-
 static void
 stbroadcast_recv(struct stbroadcast_conn *c)
 {
+	if (packetbuf_datalen() < sizeof(predicate_check_msg_t))
+	{
+		return;
+	}
+
 	predicate_check_msg_t const * msg = (predicate_check_msg_t const *)packetbuf_dataptr();
-	uint8_t hop_limit = msg->hop_limit;
-	if (message_id_received != msg->message_id && hop_limit > highest_hops_seen) 
+
+	// A request that should not have been sent on, the
+	// wait for the hops below us would wrap around
+	if (msg->hop_limit == 0)
 	{
-		message_id_received = msg->message_id;
-		highest_hops_seen = hop_limit;
-		//send via mesh to originator
-		printf("predicate: %s\n", msg->predicate_to_check);
+		printf("Request with no hops left, ignoring\n");
+		return;
+	}
 
+	if (seen_cache_check_and_add(&seen_cache, &msg->originator, msg->message_id))
+	{
+		return;
+	}
 
+	printf("predicate: %.*s\n", PREDICATE_MAX_LENGTH, msg->predicate_to_check);
 
-		if (hop_limit > 1) //last node 
-		{
-			printf("Node resending: %s\n",addr2str(&rimeaddr_node_addr) );
-			//send message on with one less hop limit
-			send_n_hop_predicate_check(msg->originator,msg->message_id, msg->predicate_to_check,hop_limit - 1);
-		}
-	
-		
+	if (gather_is_active)
+	{
+		printf("Already gathering, not taking part\n");
+		return;
+	}
+
+	uint8_t hops = msg->hops + 1;
+	uint8_t hop_limit = msg->hop_limit;
 
+	// The reply is sent after those from the hop_limit - 1 hops below us
+	start_gather(&msg->originator, msg->message_id, &msg->sender, hops, hop_limit - 1);
+
+	if (hop_limit > 1) //last node 
+	{
+		printf("Node resending: %s\n",addr2str(&rimeaddr_node_addr) );
+		//send message on with one less hop limit
+		send_n_hop_predicate_check(&msg->originator, msg->message_id, msg->predicate_to_check, hop_limit - 1, hops);
 	}
 }
 
@@ -140,8 +311,44 @@ stbroadcast_sent(struct stbroadcast_conn *c)
 	//printf("I've sent!\n");
 }
 
+static void
+runicast_recv(struct runicast_conn *c, rimeaddr_t const * from, uint8_t seqno)
+{
+	gather_reply_msg_t const * msg = (gather_reply_msg_t const *)packetbuf_dataptr();
+
+	if (packetbuf_datalen() < sizeof(gather_reply_msg_t) ||
+		packetbuf_datalen() < sizeof(gather_reply_msg_t) + msg->count * sizeof(gathered_data_t))
+	{
+		printf("Reply too short from %s\n", addr2str(from));
+		return;
+	}
+
+	if (!gather_is_active || gather_message_id != msg->message_id ||
+		!rimeaddr_cmp(&gather_originator, &msg->originator))
+	{
+		printf("Reply from %s is too late\n", addr2str(from));
+		return;
+	}
+
+	// Replies are aggregated into ours on the way back to the originator
+	gathered_data_t const * data = (gathered_data_t const *)(msg + 1);
+
+	uint8_t i;
+	for (i = 0; i != msg->count; ++i)
+	{
+		gather_add(&data[i]);
+	}
+}
+
+static void
+runicast_timedout(struct runicast_conn *c, rimeaddr_t const * to, uint8_t retransmissions)
+{
+	printf("Reply to %s timedout\n", addr2str(to));
+}
+
 const static struct mesh_callbacks meshCallbacks = {mesh_recv, mesh_sent, mesh_timedout};
 const static struct stbroadcast_callbacks stbroadcastCallbacks = {stbroadcast_recv, stbroadcast_sent};
+const static struct runicast_callbacks runicastCallbacks = {runicast_recv, NULL, runicast_timedout};
 
 static void
 cancel_stbroadcast()
@@ -176,7 +383,7 @@ sendToBaseStation(char* message)
 }
 
 static void
-send_n_hop_predicate_check(rimeaddr_t originator, uint8_t message_id_to_send, char* pred, uint8_t hop_limit)
+send_n_hop_predicate_check(rimeaddr_t const * originator, uint8_t message_id_to_send, char const * pred, uint8_t hop_limit, uint8_t hops)
 {
 	packetbuf_clear();
 	packetbuf_set_datalen(sizeof(predicate_check_msg_t));
@@ -184,17 +391,19 @@ send_n_hop_predicate_check(rimeaddr_t originator, uint8_t message_id_to_send, ch
 	predicate_check_msg_t * msg = (predicate_check_msg_t *)packetbuf_dataptr();
 	memset(msg, 0, sizeof(predicate_check_msg_t));
 
-	msg->originator = rimeaddr_node_addr;
+	rimeaddr_copy(&msg->originator, originator);
+	rimeaddr_copy(&msg->sender, &rimeaddr_node_addr);
 	msg->message_id = message_id_to_send;
-	msg->predicate_to_check = pred;
+	strncpy(msg->predicate_to_check, pred, PREDICATE_MAX_LENGTH);
 	msg->hop_limit = hop_limit;
+	msg->hops = hops;
 
 	stbroadcast_send_stubborn(&stbroadcast, CLOCK_SECOND);
 
 	
 	static struct ctimer stbroadcast_stop_timer;
 
-	ctimer_set(&stbroadcast_stop_timer, 20 * CLOCK_SECOND, &cancel_stbroadcast, NULL);
+	ctimer_set(&stbroadcast_stop_timer, STUBBORN_DURATION, &cancel_stbroadcast, NULL);
 }
 
 PROCESS(networkInit, "Network Init");
@@ -241,7 +450,9 @@ PROCESS_THREAD(mainProcess, ev, data)
 	}
 	else
 	{
+		seen_cache_init(&seen_cache);
 		stbroadcast_open(&stbroadcast, 8, &stbroadcastCallbacks);
+		runicast_open(&runicast, 10, &runicastCallbacks);
 		etimer_set(&et, 20 * CLOCK_SECOND); //10 second timer
 		PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
 		
@@ -255,8 +466,7 @@ PROCESS_THREAD(mainProcess, ev, data)
 			static int count = 0;
 			if(rimeaddr_cmp(&rimeaddr_node_addr, &test) && count++ == 0)
 			{
-				message_id_received = get_message_id();
-				send_n_hop_predicate_check(rimeaddr_node_addr,message_id_received, "Hello World!!!", 2);
+				n_hop_gather("Hello World!!!", 2);
 			}
 
 			PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
@@ -267,5 +477,6 @@ PROCESS_THREAD(mainProcess, ev, data)
 		printf("Exiting Process...\n");
 		mesh_close(&mesh);
 		stbroadcast_close(&stbroadcast);
+		runicast_close(&runicast);
 		PROCESS_END();
 }
\ No newline at end of file
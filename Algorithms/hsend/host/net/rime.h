@@ -0,0 +1,25 @@
+// The parts of Contiki's net/rime.h that the seen cache uses,
+// so it can be built and tested on the host.
+#ifndef HOST_RIME_H
+#define HOST_RIME_H
+
+#include <string.h>
+
+#define RIMEADDR_SIZE 2
+
+typedef union
+{
+	unsigned char u8[RIMEADDR_SIZE];
+} rimeaddr_t;
+
+static inline int rimeaddr_cmp(rimeaddr_t const * addr1, rimeaddr_t const * addr2)
+{
+	return memcmp(addr1, addr2, sizeof(rimeaddr_t)) == 0;
+}
+
+static inline void rimeaddr_copy(rimeaddr_t * dest, rimeaddr_t const * src)
+{
+	memcpy(dest, src, sizeof(rimeaddr_t));
+}
+
+#endif /*HOST_RIME_H*/
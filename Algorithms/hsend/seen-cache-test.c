@@ -0,0 +1,156 @@
+// Host test and benchmark of the seen cache under high churn.
+// Messages from many originators are interleaved, as when a lot of
+// nodes are sending at once, so every insert evicts an older message.
+// Build and run with: make -f Makefile.host test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "seen-cache.h"
+
+// The number of nodes whose messages are interleaved
+static const unsigned long ORIGINATORS = 97;
+
+// The number of distinct messages sent in the churn test
+static const unsigned long MESSAGES = 200000;
+
+// How many messages back the detection rate is reported for
+#define MAX_DISTANCE (2 * SEEN_CACHE_SIZE)
+
+// The number of messages timed in the benchmark
+static const unsigned long BENCHMARK_ITERATIONS = 10000000;
+
+/** Give every message number its own originator and id.
+	Each originator's ids count up, as they do on the nodes. */
+static void message(unsigned long n, rimeaddr_t * originator, uint8_t * message_id)
+{
+	unsigned long node = n % ORIGINATORS + ORIGINATORS * (n / (ORIGINATORS * 256));
+
+	originator->u8[0] = node & 0xFF;
+	originator->u8[1] = (node >> 8) & 0xFF;
+	*message_id = (n / ORIGINATORS) % 256;
+}
+
+static bool is_seen(seen_cache_t * cache, unsigned long n)
+{
+	rimeaddr_t originator;
+	uint8_t message_id;
+	message(n, &originator, &message_id);
+
+	return seen_cache_check_and_add(cache, &originator, message_id);
+}
+
+static unsigned int check_duplicates(void)
+{
+	unsigned int failures = 0;
+	seen_cache_t cache;
+	unsigned long n;
+
+	seen_cache_init(&cache);
+
+	// With a free slot in every probe run nothing is evicted
+	for (n = 0; n != SEEN_CACHE_SIZE / SEEN_CACHE_PROBES; ++n)
+	{
+		if (is_seen(&cache, n))
+		{
+			printf("Duplicates: new message %lu reported as seen\n", n);
+			++failures;
+		}
+
+		if (!is_seen(&cache, n))
+		{
+			printf("Duplicates: message %lu not seen straight after adding it\n", n);
+			++failures;
+		}
+	}
+
+	return failures;
+}
+
+/** A message is only evicted by an insert whose probe run is full of newer
+	messages, so one is always found until SEEN_CACHE_PROBES more are added. */
+static unsigned int check_churn(void)
+{
+	unsigned int failures = 0;
+	unsigned long found[MAX_DISTANCE];
+	seen_cache_t cache;
+	unsigned long n, distance;
+
+	seen_cache_init(&cache);
+
+	for (distance = 0; distance != MAX_DISTANCE; ++distance)
+	{
+		found[distance] = 0;
+	}
+
+	for (n = 0; n != MESSAGES; ++n)
+	{
+		if (is_seen(&cache, n))
+		{
+			printf("Churn: new message %lu reported as seen\n", n);
+			++failures;
+		}
+
+		// Checking for a message that has gone adds it again,
+		// so each check is made on a copy of the cache
+		for (distance = 0; distance != MAX_DISTANCE && distance <= n; ++distance)
+		{
+			seen_cache_t copy = cache;
+
+			if (is_seen(&copy, n - distance))
+			{
+				++found[distance];
+			}
+			else if (distance < SEEN_CACHE_PROBES)
+			{
+				printf("Churn: message %lu evicted after %lu more\n", n - distance, distance);
+				++failures;
+			}
+		}
+	}
+
+	printf("Messages added since  Found\n");
+	for (distance = 0; distance != MAX_DISTANCE; ++distance)
+	{
+		printf("%20lu  %5.1f%%\n", distance,
+			100.0 * found[distance] / (MESSAGES - distance));
+	}
+
+	return failures;
+}
+
+static void benchmark(void)
+{
+	seen_cache_t cache;
+	unsigned long i;
+	unsigned long duplicates = 0;
+	clock_t start;
+
+	seen_cache_init(&cache);
+
+	// Every message is new, and then heard again from a second neighbour
+	start = clock();
+	for (i = 0; i != BENCHMARK_ITERATIONS; ++i)
+	{
+		duplicates += is_seen(&cache, i / 2);
+	}
+
+	printf("%.1f ns per check, %lu of %lu repeats found\n",
+		(double)(clock() - start) * 1e9 / CLOCKS_PER_SEC / BENCHMARK_ITERATIONS,
+		duplicates, BENCHMARK_ITERATIONS / 2);
+}
+
+int main(void)
+{
+	unsigned int failures = 0;
+
+	failures += check_duplicates();
+	failures += check_churn();
+
+	printf("%s: %u failures\n", failures == 0 ? "PASSED" : "FAILED", failures);
+
+	benchmark();
+
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,60 @@
+#include "seen-cache.h"
+
+#include <string.h>
+
+void seen_cache_init(seen_cache_t * cache)
+{
+	memset(cache, 0, sizeof(seen_cache_t));
+}
+
+static uint8_t hash(rimeaddr_t const * originator, uint8_t message_id)
+{
+	uint8_t h = message_id;
+
+	uint8_t i;
+	for (i = 0; i != sizeof(rimeaddr_t); ++i)
+	{
+		h = (h * 31) ^ originator->u8[i];
+	}
+
+	return h;
+}
+
+bool seen_cache_check_and_add(seen_cache_t * cache, rimeaddr_t const * originator, uint8_t message_id)
+{
+	uint8_t const home = hash(originator, message_id);
+
+	seen_cache_entry_t * oldest = NULL;
+
+	uint8_t i;
+	for (i = 0; i != SEEN_CACHE_PROBES; ++i)
+	{
+		seen_cache_entry_t * entry = &cache->entries[(home + i) & (SEEN_CACHE_SIZE - 1)];
+
+		if (!entry->used)
+		{
+			// Entries are never removed, so nothing is stored past a free slot
+			oldest = entry;
+			break;
+		}
+
+		if (entry->message_id == message_id && rimeaddr_cmp(&entry->originator, originator))
+		{
+			return true;
+		}
+
+		// Ages are compared relative to now so the counter can wrap
+		if (oldest == NULL ||
+			(uint16_t)(cache->next_insert - entry->inserted) > (uint16_t)(cache->next_insert - oldest->inserted))
+		{
+			oldest = entry;
+		}
+	}
+
+	rimeaddr_copy(&oldest->originator, originator);
+	oldest->message_id = message_id;
+	oldest->used = true;
+	oldest->inserted = cache->next_insert++;
+
+	return false;
+}
@@ -0,0 +1,41 @@
+#ifndef SEEN_CACHE_H
+#define SEEN_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "net/rime.h"
+
+// The number of messages remembered, this must be a power of two
+#define SEEN_CACHE_SIZE 16
+
+// How many slots after its home slot a message can be stored in.
+// When they are all used the oldest of them is replaced.
+#define SEEN_CACHE_PROBES 4
+
+typedef struct
+{
+	rimeaddr_t originator;
+	uint8_t message_id;
+
+	bool used;
+
+	// When the message was added, compared to the cache's next_insert
+	uint16_t inserted;
+
+} seen_cache_entry_t;
+
+typedef struct
+{
+	seen_cache_entry_t entries[SEEN_CACHE_SIZE];
+
+	uint16_t next_insert;
+
+} seen_cache_t;
+
+void seen_cache_init(seen_cache_t * cache);
+
+/** Records that a message has been seen, returns true if it had been already */
+bool seen_cache_check_and_add(seen_cache_t * cache, rimeaddr_t const * originator, uint8_t message_id);
+
+#endif /*SEEN_CACHE_H*/
@@ -11,8 +11,14 @@
 #	define snprintf _snprintf
 #endif
 
-#define MAIN_FUNC
-#define ENABLE_CODE_GEN
+// The example program and the code generation it uses are only
+// built on the host, motes receive their programs over the network
+#ifndef CONTIKI
+#	define MAIN_FUNC
+#	define ENABLE_CODE_GEN
+#else
+#	define NDEBUG
+#endif
 //#define NDEBUG
 
 #ifndef NDEBUG
@@ -22,7 +28,11 @@
 #endif
 
 
-#define STACK_SIZE (2 * 1024)
+#ifndef CONTIKI
+#	define STACK_SIZE (2 * 1024)
+#else
+#	define STACK_SIZE 512
+#endif
 
 #define MAXIMUM_FUNCTIONS 5
 #define MAXIMUM_VARIABLES 5
@@ -149,6 +159,7 @@ static inline bool pop_stack(nuint size)
 	return true;
 }
 
+#ifdef MAIN_FUNC
 static void inspect_stack(void)
 {
 #ifndef NDEGBUG
@@ -160,6 +171,7 @@ static void inspect_stack(void)
 	}
 #endif
 }
+#endif
 
 /****************************************************
  ** MEMORY MANAGEMENT
@@ -341,6 +353,13 @@ static inline nfloat * get_variable_as_float(char const * name)
 	return (var != NULL) ? (nfloat *)var->location : NULL;
 }
 
+void * create_user_array(char const * name, nuint length)
+{
+	variable_reg_t * var = create_array(name, strlen(name), TYPE_USER, length);
+
+	return (var != NULL) ? var->location : NULL;
+}
+
 /****************************************************
  ** VARIABLE MANAGEMENT END
  ***************************************************/
@@ -952,7 +971,7 @@ bool init_pred_lang(node_data_fn given_data_fn, nuint given_data_size)
 	if (given_data_fn == NULL)
 		return false;
 
-	if (given_data_size == NULL)
+	if (given_data_size == 0)
 		return false;
 
 	// Record the user's data access function
@@ -999,6 +1018,7 @@ bool init_pred_lang(node_data_fn given_data_fn, nuint given_data_size)
 
 
 
+#ifdef MAIN_FUNC
 /****************************************************
  ** USER CODE FROM HERE ON
  ***************************************************/
@@ -1156,7 +1176,6 @@ static void gen_example_for_loop(void)
 }
 #endif
 
-#ifdef MAIN_FUNC
 // FROM: http://www.anyexample.com/programming/c/how_to_load_file_into_memory_using_plain_ansi_c_language.xml
 nuint load_file_to_memory(char const * filename, ubyte ** result) 
 {
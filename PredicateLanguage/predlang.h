@@ -3,6 +3,10 @@
 
 #include <stdint.h>
 
+#ifndef _MSC_VER
+#	include <stdbool.h>
+#endif
+
 typedef enum
 {
 	TYPE_INTEGER = 0,
@@ -30,6 +34,10 @@ bool register_function(char const * name, data_access_fn fn, variable_type_t typ
 typedef void * (*node_data_fn)(void);
 bool init_pred_lang(node_data_fn given_data_fn, nuint given_data_size);
 
+// Create an array of user data that a program can read by name.
+// Returns the space for the length items, or NULL on failure.
+void * create_user_array(char const * name, nuint length);
+
 nbool evaluate(ubyte * start, nuint program_length);
 
 char const * error_message(void);
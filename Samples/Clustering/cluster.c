@@ -22,7 +22,10 @@
 #include "cluster.h"
 
 #include "sensor-converter.h"
+#include "sensor-mean.h"
 #include "debug-helper.h"
+#include "frame.h"
+#include "sensor-sampler.h"
 
 typedef struct
 {
@@ -67,6 +70,11 @@ static const int MAX_RUNICAST_RETX = 5;
 static const clock_time_t STUBBORN_INTERVAL = 4 * CLOCK_SECOND;
 static const clock_time_t STUBBORN_WAIT = 30 * CLOCK_SECOND;
 
+// How long a cluster head collects its members' readings for
+// before sending a summary of them, just over the sampling period
+// so each member should contribute one reading.
+static const clock_time_t AGGREGATION_WAIT = 65 * CLOCK_SECOND;
+
 
 static void stbroadcast_cancel_void(void * ptr)
 {
@@ -126,14 +134,15 @@ static void runicast_recv(struct runicast_conn * ptr,
 {
 	cluster_conn_t * conn = conncvt_runicast(ptr);
 
-	// Extract the source we included at the end of the packet
-	rimeaddr_t const * source = (rimeaddr_t const *)
-		(((char *)packetbuf_dataptr()) + packetbuf_datalen() - sizeof(rimeaddr_t));
-
-	// Change the packet length to the expected length
-	packetbuf_set_datalen(packetbuf_datalen() - sizeof(rimeaddr_t));
+	// The frame header tells us who generated the data
+	frame_header_t header;
+	if (!frame_strip(&header))
+	{
+		printf("Dropping packet without a frame header\n");
+		return;
+	}
 
-	(*conn->callbacks.recv)(conn, source);
+	(*conn->callbacks.recv)(conn, &header.originator);
 }
 
 static void runicast_sent(struct runicast_conn *c,
@@ -150,6 +159,65 @@ static void runicast_timedout(struct runicast_conn *c,
 static const struct runicast_callbacks callbacks_forward =
 	{ &runicast_recv, &runicast_sent, &runicast_timedout };
 
+
+static bool is_aggregating(cluster_conn_t const * conn)
+{
+	return conn->is_CH && conn->data != NULL;
+}
+
+/** Send the framed packet in the packetbuf on to the sink */
+static void send_to_sink(cluster_conn_t * conn)
+{
+	runicast_send(&conn->rc, &conn->sink, MAX_RUNICAST_RETX);
+}
+
+/** Send data we generated that is in the packetbuf on to the sink */
+static void send_own_to_sink(cluster_conn_t * conn)
+{
+	if (!frame_prepend(&rimeaddr_node_addr, conn->epoch++))
+	{
+		printf("No space for the frame header\n");
+		return;
+	}
+
+	send_to_sink(conn);
+}
+
+static void finish_aggregate_collect(void * ptr)
+{
+	cluster_conn_t * conn = (cluster_conn_t *)ptr;
+
+	packetbuf_clear();
+	packetbuf_set_datalen(conn->data_length);
+	debug_packet_size(conn->data_length + sizeof(frame_header_t));
+	memcpy(packetbuf_dataptr(), conn->data, conn->data_length);
+
+	conn->is_collecting = false;
+
+	printf("Sending cluster summary to the sink\n");
+
+	send_own_to_sink(conn);
+}
+
+/** Merge a reading from a member of our cluster into our summary */
+static void aggregate_reading(cluster_conn_t * conn, void const * reading)
+{
+	if (!conn->is_collecting)
+	{
+		// This is the first reading in this window
+		conn->is_collecting = true;
+
+		memcpy(conn->data, reading, conn->data_length);
+
+		static struct ctimer aggregate_ct;
+		ctimer_set(&aggregate_ct, AGGREGATION_WAIT, &finish_aggregate_collect, conn);
+	}
+	else
+	{
+		(*conn->callbacks.aggregate_update)(conn->data, reading);
+	}
+}
+
 /** The function that will be executed when a message is received */
 static void mesh_recv(struct mesh_conn * ptr, rimeaddr_t const * originator, uint8_t hops)
 {
@@ -170,12 +238,20 @@ static void mesh_recv(struct mesh_conn * ptr, rimeaddr_t const * originator, uin
 		hops
 	);
 
-	// Include the originator in the header
-	rimeaddr_t * source = (rimeaddr_t *)(((char *)packetbuf_dataptr()) + packetbuf_datalen());
-	packetbuf_set_datalen(packetbuf_datalen() + sizeof(rimeaddr_t));
-	rimeaddr_copy(source, originator);
+	if (is_aggregating(conn))
+	{
+		if (frame_strip(NULL) && packetbuf_datalen() >= conn->data_length)
+		{
+			aggregate_reading(conn, packetbuf_dataptr());
+		}
+	}
+	else
+	{
+		// The originator is already in the frame header
+		frame_forwarded();
 
-	runicast_send(&conn->rc, &conn->our_cluster_head, MAX_RUNICAST_RETX);
+		send_to_sink(conn);
+	}
 }
 
 static void mesh_sent(struct mesh_conn * c) { }
@@ -304,11 +380,27 @@ static void CH_setup_wait_finished(void * ptr)
 
 bool cluster_open(cluster_conn_t * conn, rimeaddr_t const * sink,
                   uint16_t ch1, uint16_t ch2, uint16_t ch3,
-                  cluster_callbacks_t const * callbacks)
+                  size_t data_size, cluster_callbacks_t const * callbacks)
 {
-	if (conn != NULL && sink != NULL &&
+	if (conn != NULL && sink != NULL && data_size != 0 &&
 		callbacks != NULL && callbacks->recv != NULL && callbacks->setup_complete != NULL)
 	{
+		conn->data = NULL;
+		conn->data_length = data_size;
+		conn->is_collecting = false;
+		conn->epoch = 0;
+
+		// Only need space for a summary if we are asked to aggregate
+		if (callbacks->aggregate_update != NULL)
+		{
+			conn->data = malloc(data_size);
+
+			if (conn->data == NULL)
+			{
+				return false;
+			}
+		}
+
 		stbroadcast_open(&conn->bc, ch1, &callbacks_setup);
 		mesh_open(&conn->mc, ch2, &callbacks_data);
 		runicast_open(&conn->rc, ch3, &callbacks_forward);
@@ -349,6 +441,12 @@ void cluster_close(cluster_conn_t * conn)
 		stbroadcast_close(&conn->bc);
 		mesh_close(&conn->mc);
 		runicast_close(&conn->rc);
+
+		if (conn->data != NULL)
+		{
+			free(conn->data);
+			conn->data = NULL;
+		}
 	}
 }
 
@@ -366,19 +464,18 @@ void cluster_send(cluster_conn_t * conn)
 			// We are the sink, so just call the receive function
 			(*conn->callbacks.recv)(conn, &rimeaddr_node_addr);
 		}
+		else if (is_aggregating(conn))
+		{
+			// Our own reading is part of the cluster's summary
+			aggregate_reading(conn, packetbuf_dataptr());
+		}
 		else if (conn->is_CH)
 		{
 			// The cluster head needs to use runicast to send
 			// messages to the sink, so do so.
-
-			// Include the originator in the header
-			rimeaddr_t * source = (rimeaddr_t *)(((char *)packetbuf_dataptr()) + packetbuf_datalen());
-			packetbuf_set_datalen(packetbuf_datalen() + sizeof(rimeaddr_t));
-			rimeaddr_copy(source, &rimeaddr_node_addr);
-
-			runicast_send(&conn->rc, &conn->sink, MAX_RUNICAST_RETX);
+			send_own_to_sink(conn);
 		}
-		else
+		else if (frame_prepend(&rimeaddr_node_addr, conn->epoch++))
 		{
 			// Otherwise just use mesh to send the message to the CH
 			mesh_send(&conn->mc, &conn->our_cluster_head);
@@ -400,8 +497,9 @@ AUTOSTART_PROCESSES(&startup_process);
 
 typedef struct
 {
-	double temperature;
-	double humidity;
+	// Raw readings are sent, conversion is done at the sink.
+	// Cluster heads average the readings of their members.
+	sensor_mean_t mean;
 } collect_msg_t;
 
 
@@ -409,9 +507,12 @@ static void cluster_recv(cluster_conn_t * conn, rimeaddr_t const * source)
 {
 	collect_msg_t const * msg = (collect_msg_t const *)packetbuf_dataptr();
 
-	printf("Sink rcv: Src:%s Temp:%d Hudmid:%d%%\n",
+	int16_t temperature = sht11_temperature_centi(msg->mean.raw.temperature);
+	int16_t humidity = sht11_relative_humidity_compensated_centi(msg->mean.raw.humidity, temperature);
+
+	printf("Sink rcv: Src:%s Temp:%d Hudmid:%d%% Count:%u\n",
 			addr2str(source),
-			(int)msg->temperature, (int)msg->humidity
+			temperature / 100, humidity / 100, msg->mean.count
 	);
 }
 
@@ -423,8 +524,17 @@ static void cluster_setup_finished(cluster_conn_t * conn)
 	}
 }
 
+static void cluster_aggregate_update(void * data, void const * to_apply)
+{
+	collect_msg_t * our_data = (collect_msg_t *)data;
+	collect_msg_t const * data_to_apply = (collect_msg_t const *)to_apply;
+
+	sensor_mean_merge(&our_data->mean, &data_to_apply->mean);
+}
+
 static cluster_conn_t conn;
-static cluster_callbacks_t callbacks = { &cluster_recv, &cluster_setup_finished };
+static cluster_callbacks_t callbacks =
+	{ &cluster_recv, &cluster_setup_finished, &cluster_aggregate_update };
 
 PROCESS_THREAD(startup_process, ev, data)
 {
@@ -435,15 +545,13 @@ PROCESS_THREAD(startup_process, ev, data)
 	sink.u8[0] = 1;
 	sink.u8[1] = 0;
 
-	cluster_open(&conn, &sink, 118, 132, 147, &callbacks);
+	cluster_open(&conn, &sink, 118, 132, 147, sizeof(collect_msg_t), &callbacks);
 
 	PROCESS_END();
 }
 
 PROCESS_THREAD(send_data_process, ev, data)
 {
-	static struct etimer et;
-	
 	PROCESS_BEGIN();
 
 	if (!is_sink(&conn))
@@ -452,35 +560,25 @@ PROCESS_THREAD(send_data_process, ev, data)
 
 		leds_on(LEDS_GREEN);
 
-		// Send every second.
-		etimer_set(&et, 60 * CLOCK_SECOND);
+		// Read the sensors and send every minute.
+		sensor_sampler_start(60 * CLOCK_SECOND);
 	 
 		while (true)
 		{
-			PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
-
-			// Read the data from the temp and humidity sensors
-			SENSORS_ACTIVATE(sht11_sensor);
-			unsigned raw_temperature = sht11_sensor.value(SHT11_SENSOR_TEMP);
-			unsigned raw_humidity = sht11_sensor.value(SHT11_SENSOR_HUMIDITY);
-			SENSORS_DEACTIVATE(sht11_sensor);
-
-			double temperature = sht11_temperature(raw_temperature);
-			double humidity = sht11_relative_humidity_compensated(raw_humidity, temperature);
+			PROCESS_WAIT_EVENT_UNTIL(ev == sensor_sampler_event);
 
+			sensor_reading_t const * reading = (sensor_reading_t const *)data;
 
 			// Create the data message that we are going to send
 			packetbuf_clear();
 			packetbuf_set_datalen(sizeof(collect_msg_t));
+			debug_packet_size(sizeof(collect_msg_t));
 			collect_msg_t * msg = (collect_msg_t *)packetbuf_dataptr();
 			memset(msg, 0, sizeof(collect_msg_t));
 
-			msg->temperature = temperature;
-			msg->humidity = humidity;
-		
-			cluster_send(&conn);
+			sensor_mean_init(&msg->mean, &reading->raw);
 
-			etimer_reset(&et);
+			cluster_send(&conn);
 		}
 	}
  
@@ -15,6 +15,11 @@ typedef struct
 
 	/** This function is called when a node has finished setting up */
 	void (* setup_complete)(struct cluster_conn * conn);
+
+	/** Optional, when set cluster heads merge the readings of their members
+		and only send a summary to the sink once per aggregation window.
+		The first argument is the summary, the second is the reading to merge. */
+	void (* aggregate_update)(void * data, void const * to_apply);
 } cluster_callbacks_t;
 
 typedef struct cluster_conn
@@ -35,6 +40,15 @@ typedef struct cluster_conn
 	unsigned int best_hop;
 	unsigned int collecting_best_hop;
 
+	// The summary of our members' readings
+	// when aggregating as a cluster head
+	void * data;
+	size_t data_length;
+	bool is_collecting;
+
+	// Incremented for each packet of our own we send
+	uint8_t epoch;
+
 	cluster_callbacks_t callbacks;
 
 } cluster_conn_t;
@@ -43,7 +57,7 @@ typedef struct cluster_conn
 
 bool cluster_open(cluster_conn_t * conn, rimeaddr_t const * sink,
                   uint16_t ch1, uint16_t ch2, uint16_t ch3,
-                  cluster_callbacks_t const * callbacks);
+                  size_t data_size, cluster_callbacks_t const * callbacks);
 
 void cluster_close(cluster_conn_t * conn);
 
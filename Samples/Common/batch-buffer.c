@@ -0,0 +1,119 @@
+#include "batch-buffer.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "debug-helper.h"
+
+static void batch_wait_finished(void * ptr)
+{
+	batch_flush((batch_buffer_t *)ptr);
+}
+
+bool batch_init(batch_buffer_t * batch, uint8_t record_size, uint8_t reserved,
+                clock_time_t wait, batch_flush_fn flush, void * ptr)
+{
+	if (batch == NULL || flush == NULL || record_size == 0 ||
+		record_size + reserved > BATCH_BUFFER_SIZE)
+	{
+		return false;
+	}
+
+	batch->record_size = record_size;
+	batch->capacity = (BATCH_BUFFER_SIZE - reserved) / record_size;
+	batch->count = 0;
+
+	batch->wait = wait;
+
+	batch->flush = flush;
+	batch->ptr = ptr;
+
+	return true;
+}
+
+void batch_add(batch_buffer_t * batch, void const * record)
+{
+	if (batch == NULL || record == NULL)
+	{
+		return;
+	}
+
+	memcpy(batch->data + batch->count * batch->record_size, record, batch->record_size);
+	batch->count++;
+
+	if (batch->count >= batch->capacity || batch->wait == 0)
+	{
+		batch_flush(batch);
+	}
+	else if (batch->count == 1)
+	{
+		// The first record in the batch sets how long
+		// we wait for the batch to fill up
+		ctimer_set(&batch->ct, batch->wait, &batch_wait_finished, batch);
+	}
+}
+
+void batch_flush(batch_buffer_t * batch)
+{
+	if (batch == NULL || batch->count == 0)
+	{
+		return;
+	}
+
+	ctimer_stop(&batch->ct);
+
+	uint16_t length = 1 + batch->count * batch->record_size;
+
+	packetbuf_clear();
+	packetbuf_set_datalen(length);
+	debug_packet_size(length);
+
+	uint8_t * msg = (uint8_t *)packetbuf_dataptr();
+	msg[0] = batch->count;
+	memcpy(msg + 1, batch->data, batch->count * batch->record_size);
+
+	printf("Flushing batch of %u records\n", batch->count);
+
+	batch->count = 0;
+
+	(*batch->flush)(batch->ptr);
+}
+
+void batch_clear(batch_buffer_t * batch)
+{
+	if (batch != NULL)
+	{
+		ctimer_stop(&batch->ct);
+		batch->count = 0;
+	}
+}
+
+uint8_t batch_unpack_begin(uint8_t record_size)
+{
+	uint16_t length = packetbuf_datalen();
+
+	if (length == 0 || record_size == 0)
+	{
+		return 0;
+	}
+
+	uint8_t count = *(uint8_t const *)packetbuf_dataptr();
+
+	packetbuf_hdrreduce(1);
+
+	// Do not trust a count that is larger than the packet
+	uint16_t present = (length - 1) / record_size;
+
+	if (count > present)
+	{
+		printf("Batch claims %u records, only %u present\n", count, present);
+		count = present;
+	}
+
+	return count;
+}
+
+void batch_unpack_next(uint8_t record_size)
+{
+	packetbuf_hdrreduce(record_size);
+}
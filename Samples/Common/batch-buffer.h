@@ -0,0 +1,65 @@
+#ifndef CS407_BATCH_BUFFER_H
+#define CS407_BATCH_BUFFER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "contiki.h"
+#include "net/rime.h"
+
+// CC2420 frames are at most 127 bytes. The 802.15.4 header and checksum
+// take 11 of these with short addresses, 16 more are left for the headers
+// the MAC and Rime layers put in front of the payload.
+#define BATCH_FRAME_SIZE 127
+#define BATCH_LOWER_HEADERS_SIZE (11 + 16)
+
+// The largest number of bytes of records a batch can hold.
+// A byte is needed at the start of the payload for the record count.
+#define BATCH_BUFFER_SIZE (BATCH_FRAME_SIZE - BATCH_LOWER_HEADERS_SIZE - 1)
+
+// Called once the batch has been copied into the packetbuf,
+// this function should send the packet.
+typedef void (* batch_flush_fn)(void * ptr);
+
+typedef struct
+{
+	uint8_t data[BATCH_BUFFER_SIZE];
+
+	uint8_t record_size;
+	uint8_t capacity;
+	uint8_t count;
+
+	// The longest a record will wait in the buffer before it is sent
+	clock_time_t wait;
+	struct ctimer ct;
+
+	batch_flush_fn flush;
+	void * ptr;
+
+} batch_buffer_t;
+
+/** Set up a batch of records of the given size.
+	reserved is the number of bytes the caller adds to the payload
+	before it is sent, such as its own header. A wait of 0 disables batching,
+	so each record is sent as soon as it is added. */
+bool batch_init(batch_buffer_t * batch, uint8_t record_size, uint8_t reserved,
+                clock_time_t wait, batch_flush_fn flush, void * ptr);
+
+/** Add a record to the batch, the batch is sent
+	if it becomes full or its wait expires. */
+void batch_add(batch_buffer_t * batch, void const * record);
+
+/** Send any records that are in the batch now */
+void batch_flush(batch_buffer_t * batch);
+
+/** Discard any records in the batch without sending them */
+void batch_clear(batch_buffer_t * batch);
+
+// Unpacking a received batch is done in place in the packetbuf.
+// After batch_unpack_begin the first record is at packetbuf_dataptr(),
+// each call to batch_unpack_next moves on to the next record.
+// The count returned is limited to the records that are actually present.
+uint8_t batch_unpack_begin(uint8_t record_size);
+void batch_unpack_next(uint8_t record_size);
+
+#endif /*CS407_BATCH_BUFFER_H*/
@@ -0,0 +1,56 @@
+#include "frame.h"
+
+#include <string.h>
+
+bool frame_prepend(rimeaddr_t const * originator, uint8_t epoch)
+{
+	if (originator == NULL || !packetbuf_hdralloc(sizeof(frame_header_t)))
+	{
+		return false;
+	}
+
+	frame_header_t * header = (frame_header_t *)packetbuf_hdrptr();
+
+	rimeaddr_copy(&header->originator, originator);
+	header->epoch = epoch;
+	header->hops = 0;
+
+	return true;
+}
+
+frame_header_t * frame_received(void)
+{
+	if (packetbuf_datalen() < sizeof(frame_header_t))
+	{
+		return NULL;
+	}
+
+	return (frame_header_t *)packetbuf_dataptr();
+}
+
+void frame_forwarded(void)
+{
+	frame_header_t * header = frame_received();
+
+	if (header != NULL && header->hops != UINT8_MAX)
+	{
+		++header->hops;
+	}
+}
+
+bool frame_strip(frame_header_t * header)
+{
+	frame_header_t const * received = frame_received();
+
+	if (received == NULL)
+	{
+		return false;
+	}
+
+	if (header != NULL)
+	{
+		memcpy(header, received, sizeof(frame_header_t));
+	}
+
+	return packetbuf_hdrreduce(sizeof(frame_header_t)) != 0;
+}
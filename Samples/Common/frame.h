@@ -0,0 +1,39 @@
+#ifndef CS407_FRAME_H
+#define CS407_FRAME_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "net/rime.h"
+
+/** A header placed in front of data that is forwarded over several hops,
+	so the data's originator is known without appending it to the payload. */
+typedef struct
+{
+	// The node that generated the data
+	rimeaddr_t originator;
+
+	// Incremented by the originator for each packet it sends
+	uint8_t epoch;
+
+	// The number of times the packet has been forwarded
+	uint8_t hops;
+
+} frame_header_t;
+
+/** Put a frame header in front of the data in the packetbuf.
+	Returns false if there is not enough space for the header. */
+bool frame_prepend(rimeaddr_t const * originator, uint8_t epoch);
+
+/** The frame header of a received packet, this can be changed in place
+	before the packet is forwarded. Returns NULL if the packet is too short. */
+frame_header_t * frame_received(void);
+
+/** Record that a received packet is being forwarded. */
+void frame_forwarded(void);
+
+/** Copy out the frame header of a received packet and remove it,
+	leaving the payload at packetbuf_dataptr(). */
+bool frame_strip(frame_header_t * header);
+
+#endif /*CS407_FRAME_H*/
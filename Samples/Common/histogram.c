@@ -0,0 +1,215 @@
+#include "histogram.h"
+
+#include <string.h>
+
+static unsigned int bucket_of(histogram_t const * hist, uint16_t value)
+{
+	unsigned int bucket;
+
+	if (value < hist->lower)
+	{
+		return 0;
+	}
+
+	bucket = (value - hist->lower) / hist->width;
+
+	return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+static void add_count(histogram_t * hist, unsigned int bucket, uint16_t count)
+{
+	// Saturate rather than wrap around
+	if (count > UINT16_MAX - hist->counts[bucket])
+	{
+		hist->counts[bucket] = UINT16_MAX;
+	}
+	else
+	{
+		hist->counts[bucket] += count;
+	}
+}
+
+void histogram_init(histogram_t * hist, uint16_t lower, uint16_t width)
+{
+	if (hist == NULL)
+	{
+		return;
+	}
+
+	hist->lower = lower;
+	hist->width = width == 0 ? 1 : width;
+	hist->min = UINT16_MAX;
+	hist->max = 0;
+
+	memset(hist->counts, 0, sizeof(hist->counts));
+}
+
+void histogram_add(histogram_t * hist, uint16_t value)
+{
+	if (hist == NULL)
+	{
+		return;
+	}
+
+	add_count(hist, bucket_of(hist, value), 1);
+
+	if (value < hist->min)
+		hist->min = value;
+
+	if (value > hist->max)
+		hist->max = value;
+}
+
+void histogram_merge(histogram_t * hist, histogram_t const * other)
+{
+	unsigned int i;
+
+	if (hist == NULL || other == NULL)
+	{
+		return;
+	}
+
+	bool same_buckets = hist->lower == other->lower && hist->width == other->width;
+
+	for (i = 0; i != HISTOGRAM_BUCKETS; ++i)
+	{
+		if (other->counts[i] == 0)
+		{
+			continue;
+		}
+
+		if (same_buckets)
+		{
+			add_count(hist, i, other->counts[i]);
+		}
+		else
+		{
+			// Rebucket using the middle of the other bucket
+			uint32_t middle = other->lower + (uint32_t)other->width * i + other->width / 2;
+
+			add_count(hist,
+				bucket_of(hist, middle > UINT16_MAX ? UINT16_MAX : (uint16_t)middle),
+				other->counts[i]);
+		}
+	}
+
+	if (other->min < hist->min)
+		hist->min = other->min;
+
+	if (other->max > hist->max)
+		hist->max = other->max;
+}
+
+uint32_t histogram_total(histogram_t const * hist)
+{
+	uint32_t total = 0;
+	unsigned int i;
+
+	if (hist == NULL)
+	{
+		return 0;
+	}
+
+	for (i = 0; i != HISTOGRAM_BUCKETS; ++i)
+	{
+		total += hist->counts[i];
+	}
+
+	return total;
+}
+
+/** The range of values that can have been counted in a bucket.
+	The end buckets also hold the values outside of the buckets,
+	and no value can lie outside of the range seen. */
+static void bucket_range(histogram_t const * hist, unsigned int bucket,
+                         uint32_t * low, uint32_t * high)
+{
+	*low = hist->lower + (uint32_t)hist->width * bucket;
+	*high = *low + hist->width - 1;
+
+	if (bucket == 0 || *low < hist->min)
+		*low = hist->min;
+
+	if (bucket == HISTOGRAM_BUCKETS - 1 || *high > hist->max)
+		*high = hist->max;
+}
+
+/** The value used for everything counted in a bucket */
+static uint32_t bucket_estimate(histogram_t const * hist, unsigned int bucket)
+{
+	// Use the middle of the bucket
+	uint32_t estimate = hist->lower + (uint32_t)hist->width * bucket + hist->width / 2;
+
+	// No value can lie outside of the range seen
+	if (estimate < hist->min)
+		estimate = hist->min;
+
+	if (estimate > hist->max)
+		estimate = hist->max;
+
+	return estimate;
+}
+
+uint16_t histogram_quantile(histogram_t const * hist, uint8_t percent)
+{
+	uint32_t total = histogram_total(hist);
+	uint32_t rank, seen = 0;
+	unsigned int i;
+
+	if (total == 0)
+	{
+		return 0;
+	}
+
+	if (percent > 100)
+		percent = 100;
+
+	// The rank of the value we are looking for, rounded up
+	rank = (total * percent + 99) / 100;
+	if (rank == 0)
+		rank = 1;
+
+	for (i = 0; i != HISTOGRAM_BUCKETS - 1; ++i)
+	{
+		seen += hist->counts[i];
+
+		if (seen >= rank)
+		{
+			break;
+		}
+	}
+
+	return (uint16_t)bucket_estimate(hist, i);
+}
+
+uint16_t histogram_error(histogram_t const * hist)
+{
+	uint32_t error = 0;
+	uint32_t estimate, low, high;
+	unsigned int i;
+
+	if (hist == NULL)
+	{
+		return 0;
+	}
+
+	// The furthest a value counted in a bucket can be from its estimate
+	for (i = 0; i != HISTOGRAM_BUCKETS; ++i)
+	{
+		if (hist->counts[i] == 0)
+		{
+			continue;
+		}
+
+		bucket_range(hist, i, &low, &high);
+		estimate = bucket_estimate(hist, i);
+
+		if (estimate - low > error)
+			error = estimate - low;
+
+		if (high - estimate > error)
+			error = high - estimate;
+	}
+
+	return error > UINT16_MAX ? UINT16_MAX : (uint16_t)error;
+}
@@ -0,0 +1,50 @@
+#ifndef CS407_HISTOGRAM_H
+#define CS407_HISTOGRAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The number of buckets, chosen so a histogram
+// fits in a single packet with room to spare.
+#define HISTOGRAM_BUCKETS 24
+
+/** A fixed-bucket histogram of raw sensor values that can be merged
+	as it travels up a tree. Values below the first bucket or above
+	the last are counted in those end buckets. */
+typedef struct
+{
+	// The raw value the first bucket starts at
+	uint16_t lower;
+
+	// The range of raw values each bucket covers
+	uint16_t width;
+
+	// The smallest and largest values that have been added,
+	// these tighten the estimate in the end buckets
+	uint16_t min;
+	uint16_t max;
+
+	uint16_t counts[HISTOGRAM_BUCKETS];
+
+} histogram_t;
+
+void histogram_init(histogram_t * hist, uint16_t lower, uint16_t width);
+
+void histogram_add(histogram_t * hist, uint16_t value);
+
+/** Add all the values in one histogram to another. Histograms with
+	different buckets can be merged, but this loses accuracy. */
+void histogram_merge(histogram_t * hist, histogram_t const * other);
+
+uint32_t histogram_total(histogram_t const * hist);
+
+/** Estimate the value below which the given percent of values fall.
+	The estimate is within histogram_error of the true value. */
+uint16_t histogram_quantile(histogram_t const * hist, uint8_t percent);
+
+/** The most a quantile estimate can be out by. This is half a bucket
+	unless values fell outside of the buckets, as an end bucket then
+	covers everything down to the smallest or up to the largest value. */
+uint16_t histogram_error(histogram_t const * hist);
+
+#endif /*CS407_HISTOGRAM_H*/
@@ -1,10 +1,7 @@
-#ifndef SENSOR_CONVERTER_H
-#define SENSOR_CONVERTER_H
+#ifndef SENSOR_CONVERTER_BROKEN_H
+#define SENSOR_CONVERTER_BROKEN_H
 
-double sht11_relative_humidity(unsigned raw);
-double sht11_relative_humidity_compensated(unsigned raw, double temperature);
-double sht11_temperature(unsigned raw);
-
-double battery_voltage(unsigned raw);
+// The broken converter has the same interface as the working one
+#include "sensor-converter.h"
 
 #endif
@@ -0,0 +1,151 @@
+// Host test and benchmark of the integer SHT11 conversions.
+// Every raw reading is converted by both the integer and the double
+// versions, which must agree to within MAX_ERROR hundredths.
+// Build and run with: make test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "sensor-converter.h"
+
+// The most the integer versions may differ from
+// the double versions, in hundredths of a degree or percent
+static const int MAX_ERROR = 2;
+
+// The number of times each conversion is timed over
+static const unsigned long BENCHMARK_ITERATIONS = 10000000;
+
+static int to_centi(double value)
+{
+	return (int)floor(value * 100 + 0.5);
+}
+
+static unsigned int check_temperature(void)
+{
+	unsigned int failures = 0;
+	unsigned raw;
+
+	// 14-bit temperature readings
+	for (raw = 0; raw != 1 << 14; ++raw)
+	{
+		int error = abs(sht11_temperature_centi(raw) - to_centi(sht11_temperature(raw)));
+
+		if (error > MAX_ERROR)
+		{
+			printf("Temperature Raw:%u Error:%d\n", raw, error);
+			++failures;
+		}
+	}
+
+	return failures;
+}
+
+static unsigned int check_humidity(void)
+{
+	unsigned int failures = 0;
+	unsigned raw;
+
+	// 12-bit humidity readings
+	for (raw = 0; raw != 1 << 12; ++raw)
+	{
+		int error = abs(sht11_relative_humidity_centi(raw) - to_centi(sht11_relative_humidity(raw)));
+
+		if (error > MAX_ERROR)
+		{
+			printf("Humidity Raw:%u Error:%d\n", raw, error);
+			++failures;
+		}
+	}
+
+	return failures;
+}
+
+static unsigned int check_humidity_compensated(void)
+{
+	unsigned int failures = 0;
+	unsigned int boundary = 0;
+	unsigned raw;
+	int temperature;
+
+	// Over the range the SHT11 measures temperature in
+	for (temperature = -4000; temperature <= 12000; temperature += 25)
+	{
+		for (raw = 0; raw != 1 << 12; ++raw)
+		{
+			int integer = sht11_relative_humidity_compensated_centi(raw, (int16_t)temperature);
+			int floating = to_centi(sht11_relative_humidity_compensated(raw, temperature / 100.0));
+			int error = abs(integer - floating);
+
+			if (error <= MAX_ERROR)
+			{
+				continue;
+			}
+
+			// Values just over 99% can round to either side of the clamp to 100%
+			if ((integer == 10000 && abs(floating - 9900) <= MAX_ERROR) ||
+				(floating == 10000 && abs(integer - 9900) <= MAX_ERROR))
+			{
+				++boundary;
+				continue;
+			}
+
+			printf("Compensated humidity Raw:%u Temp:%d Error:%d\n", raw, temperature, error);
+			++failures;
+		}
+	}
+
+	printf("Compensated humidity: %u results differ only at the 99%% clamp\n", boundary);
+
+	return failures;
+}
+
+static double elapsed_ns(clock_t start)
+{
+	return (double)(clock() - start) * 1e9 / CLOCKS_PER_SEC / BENCHMARK_ITERATIONS;
+}
+
+/** On the host both versions use hardware, on the MSP430
+	the double versions use software floating point. */
+static void benchmark(void)
+{
+	volatile double floating_sink = 0;
+	volatile int32_t integer_sink = 0;
+	unsigned long i;
+	clock_t start;
+
+	start = clock();
+	for (i = 0; i != BENCHMARK_ITERATIONS; ++i)
+	{
+		unsigned raw = i & 0xFFF;
+		double temperature = sht11_temperature(6000 + raw);
+		floating_sink += sht11_relative_humidity_compensated(raw, temperature);
+	}
+	printf("Double:  %.1f ns per reading\n", elapsed_ns(start));
+
+	start = clock();
+	for (i = 0; i != BENCHMARK_ITERATIONS; ++i)
+	{
+		unsigned raw = i & 0xFFF;
+		int16_t temperature = sht11_temperature_centi(6000 + raw);
+		integer_sink += sht11_relative_humidity_compensated_centi(raw, temperature);
+	}
+	printf("Integer: %.1f ns per reading\n", elapsed_ns(start));
+}
+
+int main(void)
+{
+	unsigned int failures = 0;
+
+	failures += check_temperature();
+	failures += check_humidity();
+	failures += check_humidity_compensated();
+
+	printf("%s: %u conversions out by more than %d hundredths\n",
+		failures == 0 ? "PASSED" : "FAILED", failures, MAX_ERROR);
+
+	benchmark();
+
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -35,9 +35,11 @@ double sht11_relative_humidity_compensated(unsigned raw, double temperature)
 
 	humidity = (temperature - 25) * (t1 + t2 * raw) + humidity;
 
+#ifndef SENSOR_CONVERTER_NO_SATURATION
 	// When the humidity is greater than 99% treat it as 100%
 	if (humidity > 99)
 		humidity = 100;
+#endif
 
 	return humidity;
 }
@@ -57,6 +59,96 @@ double sht11_temperature(unsigned raw)
 	return d1 + d2 * raw;
 }
 
+// Integer versions of the conversions above. The MSP430 has no
+// floating point unit, so these use fixed point coefficients and
+// give results in hundredths of a degree or percent.
+
+// Index into the tables below for the supply voltage and the
+// resolution the sensor is running at, to match the double versions
+enum { SUPPLY_5V, SUPPLY_4V, SUPPLY_3_5V, SUPPLY_3V, SUPPLY_2_5V };
+enum { RESOLUTION_HIGH, RESOLUTION_LOW };
+
+static const uint8_t supply = SUPPLY_3V;
+static const uint8_t resolution = RESOLUTION_HIGH; // 14-bit temperature, 12-bit humidity
+
+// d1 in hundredths of a degree
+static const int16_t temperature_d1[] = { -4010, -3980, -3970, -3960, -3940 };
+
+// d2 in hundredths of a degree per count, for 14-bit then 12-bit
+static const int16_t temperature_d2[] = { 1, 4 };
+
+typedef struct
+{
+	// c1 and c2 scaled by 10^6
+	int32_t c1;
+	int32_t c2;
+
+	// c3 scaled by 10^6 is c3_scaled / (c3_pre_divide * c3_post_divide),
+	// the division is split so raw * raw * c3 does not overflow
+	uint16_t c3_scaled;
+	uint16_t c3_pre_divide;
+	uint16_t c3_post_divide;
+
+	// t1 and t2 scaled by 10^5
+	uint16_t t1;
+	uint16_t t2;
+} humidity_coefficients_t;
+
+// For 12-bit then 8-bit, c3 is always negative
+static const humidity_coefficients_t humidity_coefficients[] =
+{
+	{ -2046800, 36700, 15955, 100, 100, 1000, 8 },
+	{ -2046800, 587200, 40845, 1, 100, 1000, 128 },
+};
+
+/** Divide rounding to the nearest integer rather than towards zero */
+static int32_t divide_rounded(int32_t numerator, int32_t denominator)
+{
+	return numerator >= 0
+		? (numerator + denominator / 2) / denominator
+		: (numerator - denominator / 2) / denominator;
+}
+
+/** Output temperature in hundredths of a degree Celcius */
+int16_t sht11_temperature_centi(unsigned raw)
+{
+	return temperature_d1[supply] + temperature_d2[resolution] * (int16_t)raw;
+}
+
+/** Output relative humidity in hundredths of a percent */
+int16_t sht11_relative_humidity_centi(unsigned raw)
+{
+	humidity_coefficients_t const * c = &humidity_coefficients[resolution];
+
+	uint32_t square = ((uint32_t)raw * raw) / c->c3_pre_divide;
+
+	// Scaled by 10^4 from hundredths of a percent
+	int32_t humidity = c->c1 + c->c2 * (int32_t)raw
+		- (int32_t)((square * c->c3_scaled) / c->c3_post_divide);
+
+	return (int16_t)divide_rounded(humidity, 10000);
+}
+
+int16_t sht11_relative_humidity_compensated_centi(unsigned raw, int16_t temperature)
+{
+	humidity_coefficients_t const * c = &humidity_coefficients[resolution];
+
+	int32_t humidity = sht11_relative_humidity_centi(raw);
+
+	// Compensation scaled by 10^5
+	int32_t compensation = ((int32_t)temperature - 2500) * (c->t1 + (int32_t)c->t2 * raw);
+
+	humidity += divide_rounded(compensation, 100000);
+
+#ifndef SENSOR_CONVERTER_NO_SATURATION
+	// When the humidity is greater than 99% treat it as 100%
+	if (humidity > 9900)
+		humidity = 10000;
+#endif
+
+	return (int16_t)humidity;
+}
+
 /** From: www.scribd.com/doc/73156710/Contiki-1 */
 double battery_voltage(unsigned raw)
 {
@@ -1,10 +1,27 @@
 #ifndef SENSOR_CONVERTER_H
 #define SENSOR_CONVERTER_H
 
+#include <stdint.h>
+
+// The raw readings from the SHT11, a 14-bit temperature and
+// a 12-bit humidity. These are what is sent over the network,
+// conversion to real units only happens at the sink.
+typedef struct
+{
+	uint16_t temperature;
+	uint16_t humidity;
+} sht11_raw_t;
+
 double sht11_relative_humidity(unsigned raw);
 double sht11_relative_humidity_compensated(unsigned raw, double temperature);
 double sht11_temperature(unsigned raw);
 
+// Integer versions giving hundredths of a degree or percent,
+// these avoid software floating point on the motes.
+int16_t sht11_relative_humidity_centi(unsigned raw);
+int16_t sht11_relative_humidity_compensated_centi(unsigned raw, int16_t temperature);
+int16_t sht11_temperature_centi(unsigned raw);
+
 double battery_voltage(unsigned raw);
 
 #endif
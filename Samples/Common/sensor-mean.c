@@ -0,0 +1,36 @@
+#include "sensor-mean.h"
+
+#include <stddef.h>
+
+/** Weighted average of two raw values */
+static uint16_t raw_mean(uint16_t a, uint16_t a_count, uint16_t b, uint16_t b_count)
+{
+	return (uint16_t)(((uint32_t)a * a_count + (uint32_t)b * b_count) / (a_count + b_count));
+}
+
+void sensor_mean_init(sensor_mean_t * mean, sht11_raw_t const * raw)
+{
+	if (mean != NULL && raw != NULL)
+	{
+		mean->raw = *raw;
+		mean->count = 1;
+	}
+}
+
+void sensor_mean_merge(sensor_mean_t * mean, sensor_mean_t const * other)
+{
+	if (mean == NULL || other == NULL || other->count == 0)
+	{
+		return;
+	}
+
+	mean->raw.temperature = raw_mean(
+		mean->raw.temperature, mean->count,
+		other->raw.temperature, other->count);
+
+	mean->raw.humidity = raw_mean(
+		mean->raw.humidity, mean->count,
+		other->raw.humidity, other->count);
+
+	mean->count += other->count;
+}
@@ -0,0 +1,27 @@
+#ifndef CS407_SENSOR_MEAN_H
+#define CS407_SENSOR_MEAN_H
+
+#include <stdint.h>
+
+#include "sensor-converter.h"
+
+/** The mean of a number of raw SHT11 readings. Raw readings are
+	averaged so that conversion only needs to happen at the sink. */
+typedef struct
+{
+	// The raw readings averaged over all the readings in this mean
+	sht11_raw_t raw;
+
+	// The number of readings that have been averaged
+	uint16_t count;
+
+} sensor_mean_t;
+
+/** Start a mean off with a single reading */
+void sensor_mean_init(sensor_mean_t * mean, sht11_raw_t const * raw);
+
+/** Add the readings in other to mean, each mean is
+	weighted by the number of readings it holds. */
+void sensor_mean_merge(sensor_mean_t * mean, sensor_mean_t const * other);
+
+#endif /*CS407_SENSOR_MEAN_H*/
@@ -0,0 +1,86 @@
+#include "sensor-sampler.h"
+
+#include <stdio.h>
+
+#include "lib/sensors.h"
+#include "dev/sht11.h"
+#include "dev/sht11-sensor.h"
+
+PROCESS(sensor_sampler_process, "Sensor Sampler");
+
+process_event_t sensor_sampler_event;
+
+static clock_time_t sample_period;
+
+static sensor_reading_t reading;
+static bool has_reading = false;
+
+/** Reading the SHT11 is slow, so this should be done as little as possible */
+static void take_reading(void)
+{
+	SENSORS_ACTIVATE(sht11_sensor);
+	reading.raw.temperature = sht11_sensor.value(SHT11_SENSOR_TEMP);
+	reading.raw.humidity = sht11_sensor.value(SHT11_SENSOR_HUMIDITY);
+	SENSORS_DEACTIVATE(sht11_sensor);
+
+	// Convert to human understandable values once for everyone
+	reading.temperature = sht11_temperature_centi(reading.raw.temperature);
+	reading.humidity = sht11_relative_humidity_compensated_centi(reading.raw.humidity, reading.temperature);
+
+	reading.time = clock_seconds();
+
+	has_reading = true;
+}
+
+void sensor_sampler_start(clock_time_t period)
+{
+	sample_period = period;
+
+	if (sensor_sampler_event == 0)
+	{
+		sensor_sampler_event = process_alloc_event();
+	}
+
+	if (!process_is_running(&sensor_sampler_process))
+	{
+		process_start(&sensor_sampler_process, NULL);
+	}
+}
+
+void sensor_sampler_stop(void)
+{
+	process_exit(&sensor_sampler_process);
+}
+
+sensor_reading_t const * sensor_sampler_get(unsigned long max_age)
+{
+	if (!has_reading || clock_seconds() - reading.time > max_age)
+	{
+		take_reading();
+	}
+
+	return &reading;
+}
+
+PROCESS_THREAD(sensor_sampler_process, ev, data)
+{
+	static struct etimer et;
+
+	PROCESS_BEGIN();
+
+	etimer_set(&et, sample_period);
+
+	while (true)
+	{
+		PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
+
+		take_reading();
+
+		process_post(PROCESS_BROADCAST, sensor_sampler_event, &reading);
+
+		// The period may have been changed since the timer was set
+		etimer_set(&et, sample_period);
+	}
+
+	PROCESS_END();
+}
@@ -0,0 +1,44 @@
+#ifndef CS407_SENSOR_SAMPLER_H
+#define CS407_SENSOR_SAMPLER_H
+
+#include <stdbool.h>
+
+#include "contiki.h"
+
+#include "sensor-converter.h"
+
+typedef struct
+{
+	// The readings as they came from the SHT11
+	sht11_raw_t raw;
+
+	// The readings converted to hundredths of a degree Celcius and
+	// of a percent relative humidity, integers avoid software floating
+	// point on the motes for apps that only send the raw readings
+	int16_t temperature;
+	int16_t humidity;
+
+	// When the readings were taken, in seconds
+	unsigned long time;
+
+} sensor_reading_t;
+
+// Posted to all processes after each scheduled reading,
+// the data is a sensor_reading_t const * to the new reading.
+extern process_event_t sensor_sampler_event;
+
+PROCESS_NAME(sensor_sampler_process);
+
+/** Start reading the sensors every period, if the
+	sampler is already running only the period is changed. */
+void sensor_sampler_start(clock_time_t period);
+
+void sensor_sampler_stop(void);
+
+/** Get a reading that is at most max_age seconds old.
+	The cached reading is used if it is new enough, otherwise the
+	sensors are read now. The reading is only valid until the next
+	reading is taken, so copy out anything that is needed later. */
+sensor_reading_t const * sensor_sampler_get(unsigned long max_age);
+
+#endif /*CS407_SENSOR_SAMPLER_H*/
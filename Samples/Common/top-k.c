@@ -0,0 +1,94 @@
+#include "top-k.h"
+
+#include <string.h>
+
+void top_k_init(top_k_t * top)
+{
+	if (top == NULL)
+	{
+		return;
+	}
+
+	memset(top, 0, sizeof(top_k_t));
+}
+
+/** Remove an entry, moving the ones after it up */
+static void remove_entry(top_k_t * top, uint8_t index)
+{
+	memmove(&top->entries[index], &top->entries[index + 1],
+		(top->count - index - 1) * sizeof(top_k_entry_t));
+
+	--top->count;
+}
+
+void top_k_add(top_k_t * top, rimeaddr_t const * addr, uint16_t value)
+{
+	uint8_t i, position;
+
+	if (top == NULL || addr == NULL)
+	{
+		return;
+	}
+
+	// If we already have this node only keep its highest value
+	for (i = 0; i != top->count; ++i)
+	{
+		if (rimeaddr_cmp(&top->entries[i].addr, addr) != 0)
+		{
+			if (top->entries[i].value >= value)
+			{
+				return;
+			}
+
+			remove_entry(top, i);
+			break;
+		}
+	}
+
+	// Find where this value goes
+	for (position = 0; position != top->count; ++position)
+	{
+		if (value > top->entries[position].value)
+		{
+			break;
+		}
+	}
+
+	// Lower than everything we are keeping
+	if (position == TOP_K)
+	{
+		return;
+	}
+
+	// Make room, dropping the lowest entry if we are full
+	if (top->count == TOP_K)
+	{
+		--top->count;
+	}
+
+	memmove(&top->entries[position + 1], &top->entries[position],
+		(top->count - position) * sizeof(top_k_entry_t));
+
+	rimeaddr_copy(&top->entries[position].addr, addr);
+	top->entries[position].value = value;
+
+	++top->count;
+}
+
+void top_k_merge(top_k_t * top, top_k_t const * other)
+{
+	uint8_t i, count;
+
+	if (top == NULL || other == NULL)
+	{
+		return;
+	}
+
+	// Never trust a count from the network to be in range
+	count = other->count < TOP_K ? other->count : TOP_K;
+
+	for (i = 0; i != count; ++i)
+	{
+		top_k_add(top, &other->entries[i].addr, other->entries[i].value);
+	}
+}
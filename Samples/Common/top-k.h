@@ -0,0 +1,34 @@
+#ifndef CS407_TOP_K_H
+#define CS407_TOP_K_H
+
+#include <stdint.h>
+
+#include "net/rime.h"
+
+// The number of highest values that are kept
+#define TOP_K 5
+
+typedef struct
+{
+	rimeaddr_t addr;
+	uint16_t value;
+} top_k_entry_t;
+
+/** The K highest values seen and the nodes they came from,
+	kept in order of highest value first. Each node appears
+	at most once, with the highest value it has given. */
+typedef struct
+{
+	uint8_t count;
+	top_k_entry_t entries[TOP_K];
+
+} top_k_t;
+
+void top_k_init(top_k_t * top);
+
+void top_k_add(top_k_t * top, rimeaddr_t const * addr, uint16_t value);
+
+/** Merge the entries of other into top, only keeping the K highest */
+void top_k_merge(top_k_t * top, top_k_t const * other);
+
+#endif /*CS407_TOP_K_H*/
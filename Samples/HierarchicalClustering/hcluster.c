@@ -14,15 +14,22 @@
 
 #include "net/netstack.h"
 #include "net/rime.h"
+#include "net/rime/broadcast.h"
 #include "net/rime/stbroadcast.h"
 #include "net/rime/runicast.h"
-#include "net/rime/mesh.h"
+#include "net/queuebuf.h"
 #include "contiki-net.h"
 
+#include "lib/random.h"
+
 #include "hcluster.h"
 
-#include "sensor-converter.h"
+#include "sensor-converter.h"
+#include "sensor-mean.h"
 #include "debug-helper.h"
+#include "batch-buffer.h"
+#include "frame.h"
+#include "sensor-sampler.h"
 
 typedef struct
 {
@@ -32,23 +39,58 @@ typedef struct
 	unsigned int head_level;
 	unsigned int hop_count;
 
+	// The depth of the head's cluster
+	unsigned int cluster_depth;
+
 } setup_msg_t;
 
+typedef enum
+{
+	election_message_type,
+	claim_message_type,
+	handover_message_type,
+	density_probe_message_type,
+	density_reply_message_type
+
+} rotation_message_type_t;
+
+typedef struct
+{
+	uint8_t type;
+
+	// The cluster head that is being replaced
+	rimeaddr_t head;
+
+	// The candidate's score for a claim, or the
+	// score a candidate must beat for an election
+	uint16_t score;
+
+	// The candidate for a claim, or the new head for a handover
+	rimeaddr_t new_head;
+
+	// Where the new head should send its readings to,
+	// and the neighbour the old head sent them through
+	rimeaddr_t upstream;
+	rimeaddr_t upstream_next_hop;
+	unsigned int upstream_hop;
+
+} rotation_msg_t;
+
 
 static cluster_conn_t * conncvt_stbcast(struct stbroadcast_conn * conn)
 {
 	return (cluster_conn_t *)conn;
 }
 
-static cluster_conn_t * conncvt_mesh(struct mesh_conn * conn)
+static cluster_conn_t * conncvt_runicast(struct runicast_conn * conn)
 {
 	return (cluster_conn_t *)(((char *)conn) - sizeof(struct stbroadcast_conn));
 }
 
-static cluster_conn_t * conncvt_runicast(struct runicast_conn * conn)
+static cluster_conn_t * conncvt_broadcast(struct broadcast_conn * conn)
 {
 	return (cluster_conn_t *)
-		(((char *)conn) - sizeof(struct stbroadcast_conn) - sizeof(struct mesh_conn));
+		(((char *)conn) - sizeof(struct stbroadcast_conn) - sizeof(struct runicast_conn));
 }
 
 
@@ -72,6 +114,47 @@ static const int MAX_RUNICAST_RETX = 4;
 static const clock_time_t STUBBORN_INTERVAL = 5 * CLOCK_SECOND;
 static const clock_time_t STUBBORN_WAIT = 30 * CLOCK_SECOND;
 
+// How long past the batch wait a cluster head collects its
+// members' readings for before sending a summary of them
+static const clock_time_t AGGREGATION_WAIT = 20 * CLOCK_SECOND;
+
+// How often, in seconds, cluster heads try to hand over their role
+static const unsigned long ROTATION_PERIOD = 30 * 60;
+static const clock_time_t ROTATION_CHECK = 60 * CLOCK_SECOND;
+
+// How long a cluster head waits for claims to replace it
+static const clock_time_t ELECTION_WAIT = 10 * CLOCK_SECOND;
+
+// How often the old head resends a handover until the new head
+// acknowledges it, and how many times before it stays cluster head
+static const clock_time_t HANDOVER_RETRY = 2 * CLOCK_SECOND;
+static const uint8_t HANDOVER_ATTEMPTS = 4;
+
+// How long to wait before sending from the forward
+// queue again when the runicast could not send
+static const clock_time_t FORWARD_RETRY = CLOCK_SECOND;
+
+// Packets forwarded more times than this are in a routing loop
+static const uint8_t MAX_FORWARD_HOPS = 32;
+
+// The longest a candidate waits before claiming, better candidates
+// claim sooner so that worse ones hear them and stay quiet.
+static const clock_time_t CLAIM_BACKOFF_MAX = 8 * CLOCK_SECOND;
+
+// Scores are battery millivolts less a penalty for each packet forwarded.
+// A candidate must beat the current head by the hysteresis to replace it.
+static const uint16_t LOAD_PENALTY = 2;
+static const uint16_t SCORE_HYSTERESIS = 100;
+
+// How long a new cluster head counts replies to its density probe for,
+// and the window neighbours spread their replies over
+static const clock_time_t DENSITY_WAIT = 6 * CLOCK_SECOND;
+static const clock_time_t DENSITY_REPLY_SPREAD = 4 * CLOCK_SECOND;
+
+// The range of depths cluster heads can pick for their cluster
+static const unsigned int MIN_CLUSTER_DEPTH = 1;
+static const unsigned int MAX_CLUSTER_DEPTH = 4;
+
 
 static void stbroadcast_cancel_void(void * ptr)
 {
@@ -87,7 +170,495 @@ static void stbroadcast_cancel_void(void * ptr)
 	}
 }
 
-static void forward_setup(void * ptr)
+static cluster_neighbour_t * find_neighbour(cluster_conn_t * conn, rimeaddr_t const * addr)
+{
+	unsigned int i;
+	for (i = 0; i != CLUSTER_MAX_NEIGHBOURS; ++i)
+	{
+		if (rimeaddr_cmp(&conn->neighbours[i].addr, addr) != 0)
+		{
+			return &conn->neighbours[i];
+		}
+	}
+
+	return NULL;
+}
+
+/** Record the offer a neighbour made in its setup message */
+static void update_neighbour(cluster_conn_t * conn, rimeaddr_t const * addr,
+                             rimeaddr_t const * head, unsigned int hop_count)
+{
+	cluster_neighbour_t * neighbour = find_neighbour(conn, addr);
+
+	if (neighbour == NULL)
+	{
+		// Use an empty entry, or replace the one furthest from its head
+		unsigned int i;
+		for (i = 0; i != CLUSTER_MAX_NEIGHBOURS; ++i)
+		{
+			cluster_neighbour_t * current = &conn->neighbours[i];
+
+			if (rimeaddr_cmp(&current->addr, &rimeaddr_null) != 0)
+			{
+				neighbour = current;
+				break;
+			}
+
+			if (current->hop_count > hop_count &&
+				(neighbour == NULL || current->hop_count > neighbour->hop_count))
+			{
+				neighbour = current;
+			}
+		}
+
+		if (neighbour == NULL)
+		{
+			return;
+		}
+
+		rimeaddr_copy(&neighbour->addr, addr);
+	}
+
+	rimeaddr_copy(&neighbour->head, head);
+	neighbour->hop_count = hop_count;
+}
+
+/** Find a neighbour we can send through to reach the upstream of a
+	cluster head we might replace, or NULL if we know of none. */
+static rimeaddr_t const * find_upstream_neighbour(cluster_conn_t * conn,
+	rimeaddr_t const * upstream, rimeaddr_t const * upstream_next_hop)
+{
+	cluster_neighbour_t const * best = NULL;
+	unsigned int i;
+
+	// We can reach the upstream directly
+	if (find_neighbour(conn, upstream) != NULL)
+	{
+		return upstream;
+	}
+
+	// We can use the same route as the old head
+	if (find_neighbour(conn, upstream_next_hop) != NULL)
+	{
+		return upstream_next_hop;
+	}
+
+	// Otherwise go through the closest member of the upstream cluster
+	for (i = 0; i != CLUSTER_MAX_NEIGHBOURS; ++i)
+	{
+		cluster_neighbour_t const * current = &conn->neighbours[i];
+
+		if (rimeaddr_cmp(&current->addr, &rimeaddr_null) == 0 &&
+			rimeaddr_cmp(&current->head, upstream) != 0 &&
+			(best == NULL || current->hop_count < best->hop_count))
+		{
+			best = current;
+		}
+	}
+
+	return best == NULL ? NULL : &best->addr;
+}
+
+/** Count a neighbour that replied to our density probe. Each one is only
+	counted once, using a bitmap of hashed addresses rather than the
+	neighbour table, so the count is not limited by the table's size. */
+static void count_density_reply(cluster_conn_t * conn, rimeaddr_t const * addr)
+{
+	uint8_t hash = 0;
+	unsigned int i;
+	for (i = 0; i != sizeof(rimeaddr_t); ++i)
+	{
+		hash = hash * 31 + addr->u8[i];
+	}
+
+	uint8_t mask = 1 << (hash % 8);
+
+	if ((conn->density_replies[hash / 8] & mask) == 0)
+	{
+		conn->density_replies[hash / 8] |= mask;
+		++conn->density_reply_count;
+	}
+}
+
+/** Pick the smallest depth that should give our cluster the target size.
+	Nodes k hops away are assumed to form a ring of about k times as many
+	nodes as we have neighbours, so dense areas get shallow clusters. */
+static unsigned int choose_cluster_depth(cluster_conn_t const * conn)
+{
+	unsigned int density = conn->density_reply_count;
+	unsigned int depth;
+
+	for (depth = MIN_CLUSTER_DEPTH; depth < MAX_CLUSTER_DEPTH; ++depth)
+	{
+		unsigned int size = 1 + density * depth * (depth + 1) / 2;
+
+		if (size >= conn->target_cluster_size)
+		{
+			break;
+		}
+	}
+
+	printf("Neighbours:%u Target size:%u Depth:%u\n",
+		density, conn->target_cluster_size, depth);
+
+	return depth;
+}
+
+/** How suitable this node is to be a cluster head,
+	based on its remaining energy and recent forwarding load */
+static uint16_t rotation_score(cluster_conn_t const * conn)
+{
+	SENSORS_ACTIVATE(battery_sensor);
+	unsigned raw = battery_sensor.value(0);
+	SENSORS_DEACTIVATE(battery_sensor);
+
+	uint16_t millivolts = (uint16_t)(battery_voltage(raw) * 1000);
+	uint32_t penalty = (uint32_t)conn->forwarded * LOAD_PENALTY;
+
+	return penalty >= millivolts ? 0 : millivolts - (uint16_t)penalty;
+}
+
+static void send_rotation(cluster_conn_t * conn, rotation_msg_t const * msg)
+{
+	packetbuf_clear();
+	packetbuf_set_datalen(sizeof(rotation_msg_t));
+	debug_packet_size(sizeof(rotation_msg_t));
+	memcpy(packetbuf_dataptr(), msg, sizeof(rotation_msg_t));
+
+	broadcast_send(&conn->rotation_bc);
+}
+
+/** Offer the cluster head role to the best candidate. The handover is
+	broadcast unacknowledged, so it is resent until the new head resends it. */
+static void send_handover(void * ptr)
+{
+	cluster_conn_t * conn = (cluster_conn_t *)ptr;
+
+	if (conn->handover_attempts == HANDOVER_ATTEMPTS)
+	{
+		printf("No handover ack from %s, remaining CH\n", addr2str(&conn->best_candidate));
+		conn->is_handing_over = false;
+		return;
+	}
+
+	++conn->handover_attempts;
+
+	printf("Handing over CH to %s, attempt %u\n",
+		addr2str(&conn->best_candidate), conn->handover_attempts);
+
+	rotation_msg_t msg;
+	memset(&msg, 0, sizeof(rotation_msg_t));
+
+	msg.type = handover_message_type;
+	rimeaddr_copy(&msg.head, &rimeaddr_node_addr);
+	rimeaddr_copy(&msg.new_head, &conn->best_candidate);
+	rimeaddr_copy(&msg.upstream, &conn->our_cluster_head);
+	rimeaddr_copy(&msg.upstream_next_hop, &conn->next_hop);
+	msg.upstream_hop = conn->best_hop;
+
+	send_rotation(conn, &msg);
+
+	ctimer_set(&conn->handover_ct, HANDOVER_RETRY, &send_handover, conn);
+}
+
+/** The new head has resent our handover, so it is now cluster head */
+static void handover_acknowledged(cluster_conn_t * conn)
+{
+	ctimer_stop(&conn->handover_ct);
+	conn->is_handing_over = false;
+
+	printf("Handed over CH to %s\n", addr2str(&conn->best_candidate));
+
+	// We become a member of the new head's cluster, it is our neighbour.
+	// Anything we receive from members that have not heard of the change
+	// is now forwarded on to the new head.
+	conn->is_CH = false;
+	rimeaddr_copy(&conn->our_cluster_head, &conn->best_candidate);
+	rimeaddr_copy(&conn->next_hop, &conn->best_candidate);
+	conn->best_hop = 0;
+
+	leds_off(LEDS_BLUE);
+}
+
+static void election_finished(void * ptr)
+{
+	cluster_conn_t * conn = (cluster_conn_t *)ptr;
+
+	conn->is_electing = false;
+	conn->last_rotation = clock_seconds();
+	conn->forwarded = 0;
+
+	if (rimeaddr_cmp(&conn->best_candidate, &rimeaddr_null) != 0)
+	{
+		printf("No better CH candidate, remaining CH\n");
+		return;
+	}
+
+	// Remain cluster head until the candidate has taken over
+	conn->is_handing_over = true;
+	conn->handover_attempts = 0;
+
+	send_handover(conn);
+}
+
+static void start_election(cluster_conn_t * conn)
+{
+	static struct ctimer election_ct;
+
+	conn->is_electing = true;
+	rimeaddr_copy(&conn->best_candidate, &rimeaddr_null);
+	conn->best_candidate_score = rotation_score(conn) + SCORE_HYSTERESIS;
+
+	printf("Starting CH election, score to beat:%u\n", conn->best_candidate_score);
+
+	rotation_msg_t msg;
+	memset(&msg, 0, sizeof(rotation_msg_t));
+
+	msg.type = election_message_type;
+	rimeaddr_copy(&msg.head, &rimeaddr_node_addr);
+	msg.score = conn->best_candidate_score;
+	rimeaddr_copy(&msg.upstream, &conn->our_cluster_head);
+	rimeaddr_copy(&msg.upstream_next_hop, &conn->next_hop);
+
+	send_rotation(conn, &msg);
+
+	ctimer_set(&election_ct, ELECTION_WAIT, &election_finished, conn);
+}
+
+static void rotation_check(void * ptr)
+{
+	cluster_conn_t * conn = (cluster_conn_t *)ptr;
+	static struct ctimer check_ct;
+
+	if (conn->is_CH && !conn->is_electing && !conn->is_handing_over &&
+		clock_seconds() - conn->last_rotation >= ROTATION_PERIOD)
+	{
+		start_election(conn);
+	}
+
+	ctimer_set(&check_ct, ROTATION_CHECK, &rotation_check, conn);
+}
+
+static void send_claim(void * ptr)
+{
+	cluster_conn_t * conn = (cluster_conn_t *)ptr;
+
+	printf("Claiming CH from %s with score:%u\n", addr2str(&conn->claim_head), conn->claim_score);
+
+	rotation_msg_t msg;
+	memset(&msg, 0, sizeof(rotation_msg_t));
+
+	msg.type = claim_message_type;
+	rimeaddr_copy(&msg.head, &conn->claim_head);
+	rimeaddr_copy(&msg.new_head, &rimeaddr_node_addr);
+	msg.score = conn->claim_score;
+
+	send_rotation(conn, &msg);
+}
+
+static void recv_election(cluster_conn_t * conn, rotation_msg_t const * msg)
+{
+	// Only members next to the head can replace it
+	if (conn->is_CH || rimeaddr_cmp(&conn->next_hop, &msg->head) == 0)
+	{
+		return;
+	}
+
+	// We must be able to reach where the head sends its readings
+	if (find_upstream_neighbour(conn, &msg->upstream, &msg->upstream_next_hop) == NULL)
+	{
+		return;
+	}
+
+	uint16_t score = rotation_score(conn);
+
+	if (score <= msg->score)
+	{
+		return;
+	}
+
+	rimeaddr_copy(&conn->claim_head, &msg->head);
+	conn->claim_score = score;
+
+	// The further we beat the head by the sooner we claim
+	clock_time_t backoff = (clock_time_t)(((uint32_t)CLAIM_BACKOFF_MAX * msg->score) / score);
+
+	ctimer_set(&conn->claim_ct, backoff, &send_claim, conn);
+}
+
+static void recv_claim(cluster_conn_t * conn, rotation_msg_t const * msg)
+{
+	// Stay quiet if a better candidate has already claimed
+	if (rimeaddr_cmp(&conn->claim_head, &msg->head) != 0 && msg->score >= conn->claim_score)
+	{
+		ctimer_stop(&conn->claim_ct);
+	}
+
+	if (conn->is_electing && rimeaddr_cmp(&msg->head, &rimeaddr_node_addr) != 0 &&
+		msg->score > conn->best_candidate_score)
+	{
+		rimeaddr_copy(&conn->best_candidate, &msg->new_head);
+		conn->best_candidate_score = msg->score;
+	}
+}
+
+static void recv_handover(cluster_conn_t * conn, rotation_msg_t const * msg, rimeaddr_t const * sender)
+{
+	ctimer_stop(&conn->claim_ct);
+
+	if (conn->is_handing_over && rimeaddr_cmp(&msg->head, &rimeaddr_node_addr) != 0)
+	{
+		// The new head resending our handover is its acknowledgement
+		if (rimeaddr_cmp(sender, &msg->new_head) != 0 &&
+			rimeaddr_cmp(&msg->new_head, &conn->best_candidate) != 0)
+		{
+			handover_acknowledged(conn);
+		}
+	}
+	else if (rimeaddr_cmp(&msg->new_head, &rimeaddr_node_addr) != 0)
+	{
+		if (conn->is_CH)
+		{
+			// The old head missed our acknowledgement and resent the
+			// handover, acknowledge it again if it is from the head we
+			// took over from. Otherwise we are already a head and
+			// the old head keeps the role when we do not reply.
+			if (rimeaddr_cmp(&conn->our_cluster_head, &msg->upstream) != 0 &&
+				rimeaddr_cmp(sender, &msg->head) != 0)
+			{
+				send_rotation(conn, msg);
+			}
+			return;
+		}
+
+		printf("Taking over as CH from %s\n", addr2str(&msg->head));
+
+		conn->is_CH = true;
+		rimeaddr_copy(&conn->our_cluster_head, &msg->upstream);
+
+		// We checked we could reach the upstream when we claimed,
+		// if that has changed try the old head's route anyway.
+		rimeaddr_t const * next_hop =
+			find_upstream_neighbour(conn, &msg->upstream, &msg->upstream_next_hop);
+
+		rimeaddr_copy(&conn->next_hop, next_hop != NULL ? next_hop : &msg->upstream_next_hop);
+
+		conn->best_hop = msg->upstream_hop + 1;
+
+		conn->forwarded = 0;
+		conn->last_rotation = clock_seconds();
+
+		leds_on(LEDS_BLUE);
+
+		// Resend the handover so members in range
+		// of us know they can send to us directly
+		send_rotation(conn, msg);
+	}
+	else if (rimeaddr_cmp(&conn->our_cluster_head, &msg->head) != 0 ||
+			 rimeaddr_cmp(&conn->our_cluster_head, &msg->new_head) != 0)
+	{
+		rimeaddr_copy(&conn->our_cluster_head, &msg->new_head);
+
+		// Only send directly if we have heard the new head, otherwise
+		// keep sending through the old head which forwards to the new one.
+		if (rimeaddr_cmp(sender, &msg->new_head) != 0)
+		{
+			rimeaddr_copy(&conn->next_hop, &msg->new_head);
+			conn->best_hop = 0;
+		}
+
+		printf("New CH:%s Next:%s\n", addr2str(&conn->our_cluster_head), addr2str(&conn->next_hop));
+	}
+}
+
+static void send_density_reply(void * ptr)
+{
+	cluster_conn_t * conn = (cluster_conn_t *)ptr;
+
+	conn->is_density_reply_pending = false;
+
+	rotation_msg_t msg;
+	memset(&msg, 0, sizeof(rotation_msg_t));
+
+	msg.type = density_reply_message_type;
+
+	send_rotation(conn, &msg);
+}
+
+static void recv_density_probe(cluster_conn_t * conn)
+{
+	// One reply is counted by every head probing at the same time
+	if (conn->is_density_reply_pending)
+	{
+		return;
+	}
+
+	conn->is_density_reply_pending = true;
+
+	// Spread the replies out so they do not collide
+	ctimer_set(&conn->density_reply_ct, random_rand() % DENSITY_REPLY_SPREAD,
+		&send_density_reply, conn);
+}
+
+static void recv_rotation(struct broadcast_conn * ptr, rimeaddr_t const * sender)
+{
+	cluster_conn_t * conn = conncvt_broadcast(ptr);
+
+	if (packetbuf_datalen() != sizeof(rotation_msg_t))
+	{
+		return;
+	}
+
+	rotation_msg_t msg;
+	memcpy(&msg, packetbuf_dataptr(), sizeof(rotation_msg_t));
+
+	// Every neighbour, including the sink, takes part in density probes
+	if (msg.type == density_probe_message_type)
+	{
+		recv_density_probe(conn);
+		return;
+	}
+
+	if (msg.type == density_reply_message_type)
+	{
+		if (conn->is_probing_density)
+		{
+			count_density_reply(conn, sender);
+		}
+		return;
+	}
+
+	if (is_sink(conn))
+	{
+		return;
+	}
+
+	switch (msg.type)
+	{
+	case election_message_type:
+		recv_election(conn, &msg);
+		break;
+
+	case claim_message_type:
+		recv_claim(conn, &msg);
+		break;
+
+	case handover_message_type:
+		recv_handover(conn, &msg, sender);
+		break;
+
+	default:
+		printf("Unknown rotation message type %u\n", msg.type);
+		break;
+	}
+}
+
+static void sent_rotation(struct broadcast_conn * c, int status, int num_tx) {}
+
+static const struct broadcast_callbacks callbacks_rotation = { &recv_rotation, &sent_rotation };
+
+
+static void forward_setup(void * ptr)
 {
 	cluster_conn_t * conn = (cluster_conn_t *)ptr;
 	static struct ctimer forward_stop;
@@ -105,8 +676,9 @@ static void forward_setup(void * ptr)
 	rimeaddr_copy(&nextmsg->head, conn->is_CH
 		? &rimeaddr_node_addr
 		: &conn->our_cluster_head);
-	nextmsg->head_level = conn->our_level;
-	nextmsg->hop_count = conn->is_CH ? 0 : conn->best_hop+1;
+	nextmsg->head_level = conn->our_level;
+	nextmsg->hop_count = conn->is_CH ? 0 : conn->best_hop+1;
+	nextmsg->cluster_depth = conn->cluster_depth;
 	
 	printf("Forwarding setup message...\n");
 	stbroadcast_send_stubborn(&conn->bc, STUBBORN_INTERVAL);
@@ -114,26 +686,77 @@ static void forward_setup(void * ptr)
 	ctimer_set(&forward_stop, STUBBORN_WAIT, &stbroadcast_cancel_void, conn);
 static struct ctimer message_offset;
 	//Inform user that this node is set up
-	(*conn->callbacks.setup_complete)(conn);
+	(*conn->callbacks.setup_complete)(conn);
+
+	// Start periodically rotating the cluster head role
+	conn->last_rotation = clock_seconds();
+	rotation_check(conn);
+}
+
+static void schedule_forward_setup(cluster_conn_t * conn)
+{
+	static struct ctimer message_offset;
+	ctimer_set(&message_offset, delay() * CLOCK_SECOND, &forward_setup, conn);
+}
+
+static void density_probe_finished(void * ptr)
+{
+	cluster_conn_t * conn = (cluster_conn_t *)ptr;
+
+	conn->is_probing_density = false;
+	conn->cluster_depth = choose_cluster_depth(conn);
+
+	schedule_forward_setup(conn);
+}
+
+/** Count our neighbours before picking our cluster depth. Nodes further
+	from the sink only send setup messages after hearing ours, so they
+	are asked directly rather than counted from the setup messages. */
+static void start_density_probe(cluster_conn_t * conn)
+{
+	static struct ctimer probe_ct;
+
+	memset(conn->density_replies, 0, sizeof(conn->density_replies));
+	conn->density_reply_count = 0;
+	conn->is_probing_density = true;
+
+	printf("Probing density before picking our cluster depth\n");
+
+	rotation_msg_t msg;
+	memset(&msg, 0, sizeof(rotation_msg_t));
+
+	msg.type = density_probe_message_type;
+	rimeaddr_copy(&msg.head, &rimeaddr_node_addr);
+
+	send_rotation(conn, &msg);
+
+	ctimer_set(&probe_ct, DENSITY_WAIT, &density_probe_finished, conn);
 }
 
 static void CH_detect_finished(void * ptr)
 {
-	cluster_conn_t * conn = (cluster_conn_t *)ptr;
-
-	clock_time_t offset = delay() * CLOCK_SECOND;
-
+	cluster_conn_t * conn = (cluster_conn_t *)ptr;
+
 	// As we are no longer listening for our parent node
 	// indicate so through the LEDs
 	leds_off(LEDS_RED);
 
 	printf("Timer on %s expired\n",	addr2str(&rimeaddr_node_addr));
 	
-	// Set the best values
-	rimeaddr_copy(&conn->our_cluster_head, &conn->collecting_best_CH);	
+	// Set the best values
+	rimeaddr_copy(&conn->our_cluster_head, &conn->collecting_best_CH);	
+	rimeaddr_copy(&conn->next_hop, &conn->collecting_next_hop);
 	conn->best_hop = conn->collecting_best_hop;
 
-	conn->is_CH = conn->best_hop == conn->cluster_depth;
+	conn->is_CH = conn->best_hop == conn->collecting_best_depth;
+
+	// Heads pick the depth of their own cluster once they have
+	// counted their neighbours, members use the depth of the
+	// cluster they are in
+	if (!conn->is_CH)
+	{
+		conn->cluster_depth = conn->collecting_best_depth;
+	}
 
 	conn->our_level = conn->is_CH
 		? conn->collecting_best_level + 1
@@ -151,44 +774,209 @@ static void CH_detect_finished(void * ptr)
 	if (conn->is_CH)
 	{
 		printf("I'm a level %u CH, come to me my children!\n",conn->our_level);
-		leds_on(LEDS_BLUE);
-	}
-
-	static struct ctimer message_offset;
-	ctimer_set(&message_offset, offset, &forward_setup, conn);
+		leds_on(LEDS_BLUE);
+	}
+
+	if (conn->is_CH && conn->target_cluster_size != 0)
+	{
+		start_density_probe(conn);
+	}
+	else
+	{
+		schedule_forward_setup(conn);
+	}
 }
 
 
+static bool is_aggregating(cluster_conn_t const * conn)
+{
+	return conn->is_CH && conn->data != NULL;
+}
+
+static void finish_aggregate_collect(void * ptr)
+{
+	cluster_conn_t * conn = (cluster_conn_t *)ptr;
+
+	conn->is_collecting = false;
+
+	printf("Sending cluster summary to:%s\n", addr2str(&conn->our_cluster_head));
+
+	// The summary is a single reading to our cluster head,
+	// there is no point delaying it any further.
+	batch_add(&conn->batch, conn->data);
+	batch_flush(&conn->batch);
+}
+
+/** Merge a reading from a member of our cluster into our summary */
+static void aggregate_reading(cluster_conn_t * conn, void const * reading)
+{
+	if (!conn->is_collecting)
+	{
+		// This is the first reading in this window, wait long enough
+		// for each member to have sent a batch of readings.
+		conn->is_collecting = true;
+
+		memcpy(conn->data, reading, conn->data_length);
+
+		static struct ctimer aggregate_ct;
+		ctimer_set(&aggregate_ct, conn->batch.wait + AGGREGATION_WAIT, &finish_aggregate_collect, conn);
+	}
+	else
+	{
+		(*conn->callbacks.aggregate_update)(conn->data, reading);
+	}
+}
+
+/** Merge a batch of readings in the packetbuf into our summary */
+static void aggregate_batch(cluster_conn_t * conn)
+{
+	uint8_t count = batch_unpack_begin(conn->data_length);
+
+	uint8_t i;
+	for (i = 0; i != count; ++i)
+	{
+		aggregate_reading(conn, packetbuf_dataptr());
+
+		batch_unpack_next(conn->data_length);
+	}
+}
+
+
+/** Send the oldest packet waiting in the forward queue. It is only
+	removed once the runicast accepts it, if it cannot be sent now,
+	for example when there are no queuebufs free, it is retried later. */
+static void send_queued(void * ptr)
+{
+	cluster_conn_t * conn = (cluster_conn_t *)ptr;
+
+	if (conn->forward_queue_length == 0 || runicast_is_transmitting(&conn->rc))
+	{
+		return;
+	}
+
+	struct queuebuf * queued = conn->forward_queue[0];
+
+	queuebuf_to_packetbuf(queued);
+
+	if (!runicast_send(&conn->rc, &conn->next_hop, MAX_RUNICAST_RETX))
+	{
+		printf("Runicast send failed, retrying queued packet\n");
+		ctimer_set(&conn->forward_retry_ct, FORWARD_RETRY, &send_queued, conn);
+		return;
+	}
+
+	--conn->forward_queue_length;
+	memmove(conn->forward_queue, conn->forward_queue + 1,
+		conn->forward_queue_length * sizeof(struct queuebuf *));
+
+	queuebuf_free(queued);
+}
+
+/** Send the framed packet in the packetbuf to the next
+	node on the way to our cluster head */
+static void send_to_head(cluster_conn_t * conn)
+{
+	if (!runicast_is_transmitting(&conn->rc) && conn->forward_queue_length == 0 &&
+		runicast_send(&conn->rc, &conn->next_hop, MAX_RUNICAST_RETX))
+	{
+		return;
+	}
+
+	// Wait for the runicast to be free, the queue is
+	// drained as each send finishes
+	struct queuebuf * queued = NULL;
+
+	if (conn->forward_queue_length != CLUSTER_FORWARD_QUEUE_SIZE)
+	{
+		queued = queuebuf_new_from_packetbuf();
+	}
+
+	if (queued == NULL)
+	{
+		printf("Forward queue full, dropping packet to:%s\n", addr2str(&conn->next_hop));
+		return;
+	}
+
+	conn->forward_queue[conn->forward_queue_length++] = queued;
+
+	printf("Runicast busy, queued packet %u\n", conn->forward_queue_length);
+
+	// No send will finish to drain the queue if the runicast is idle
+	send_queued(conn);
+}
+
+/** Forward a received packet on, the frame header is updated in place */
+static void forward(cluster_conn_t * conn)
+{
+	frame_header_t const * header = frame_received();
+
+	// While routes change a packet can be passed back and forth,
+	// so drop it rather than forward it forever
+	if (header == NULL || header->hops >= MAX_FORWARD_HOPS)
+	{
+		printf("Dropping packet forwarded too many times\n");
+		return;
+	}
+
+	frame_forwarded();
+
+	send_to_head(conn);
+}
+
+/** Pass each reading in a batch received at the sink to the user */
+static void deliver_batch(cluster_conn_t * conn)
+{
+	frame_header_t header;
+	if (!frame_strip(&header))
+	{
+		printf("Dropping packet without a frame header\n");
+		return;
+	}
+
+	printf("Sink got batch: Src:%s Epoch:%u Hops:%u\n",
+		addr2str(&header.originator), header.epoch, header.hops);
+
+	// Each packet contains a batch of readings from the originator
+	uint8_t count = batch_unpack_begin(conn->data_length);
+
+	uint8_t i;
+	for (i = 0; i != count; ++i)
+	{
+		(*conn->callbacks.recv)(conn, &header.originator);
+
+		batch_unpack_next(conn->data_length);
+	}
+}
+
+
 static void sent_runicast(struct runicast_conn *c, const rimeaddr_t *to, uint8_t retransmissions)
 {
 	printf("Runicast sent to: %s, retries: %u\n",
         addr2str(to), retransmissions);
+
+	send_queued(conncvt_runicast(c));
 }
 
 static void timedout_runicast(struct runicast_conn *c, const rimeaddr_t *to, uint8_t retransmissions)
 {
 	printf("Runicast timed out when sending to: %s, retries: %u\n",
         addr2str(to), retransmissions);
+
+	send_queued(conncvt_runicast(c));
 }
 
 static void recv_runicast(struct runicast_conn * ptr, rimeaddr_t const * originator, uint8_t seqno)
 {
 	cluster_conn_t * conn = conncvt_runicast(ptr);
 
-	// Extract the source we included at the end of the packet
-	rimeaddr_t const * source = (rimeaddr_t const *)
-		(((char *)packetbuf_dataptr()) + packetbuf_datalen() - sizeof(rimeaddr_t));
-
-	if (is_sink(conn))
-	{
-		// Change the packet length to the expected length
-		packetbuf_set_datalen(packetbuf_datalen() - sizeof(rimeaddr_t));
-
-		(*conn->callbacks.recv)(conn, source);
+	if (is_sink(conn))
+	{
+		deliver_batch(conn);
 	}else
 	{
-		// A cluster head has received a data message from a node in its cluster.
-		// We now need to forward it onto the sink.
+		// We have received a data message from a node in our cluster.
+		// If we are its cluster head we aggregate it, otherwise
+		// we forward it on towards the cluster head and the sink.
 
 		char originator_str[RIMEADDR_STRING_LENGTH];
 		char current_str[RIMEADDR_STRING_LENGTH];
@@ -199,74 +987,31 @@ static void recv_runicast(struct runicast_conn * ptr, rimeaddr_t const * origina
 			leds_on(LEDS_BLUE);
 		}
 	
-		printf("Forwarding: from:%s via:%s to:%s\n",
-			addr2str_r(originator, originator_str, RIMEADDR_STRING_LENGTH),
-			addr2str_r(&rimeaddr_node_addr, current_str, RIMEADDR_STRING_LENGTH),
-			addr2str_r(&conn->our_cluster_head, ch_str, RIMEADDR_STRING_LENGTH)
-		);
-
-		if (conn->best_hop == 0)
+		++conn->forwarded;
+
+		if (is_aggregating(conn))
 		{
-			// Include the originator in the header
-			rimeaddr_t * source = (rimeaddr_t *)(((char *)packetbuf_dataptr()) + packetbuf_datalen());
-			packetbuf_set_datalen(packetbuf_datalen() + sizeof(rimeaddr_t));
-			rimeaddr_copy(source, originator);
-			runicast_send(&conn->rc, &conn->our_cluster_head, MAX_RUNICAST_RETX);
-		}
-		else
-		{
-			mesh_send(&conn->mc, &conn->our_cluster_head);
+			// The summary is sent from us, so the frame is not needed
+			if (frame_strip(NULL))
+			{
+				aggregate_batch(conn);
+			}
+			return;
 		}
+	
+		printf("Forwarding: from:%s via:%s to:%s\n",
+			addr2str_r(originator, originator_str, RIMEADDR_STRING_LENGTH),
+			addr2str_r(&rimeaddr_node_addr, current_str, RIMEADDR_STRING_LENGTH),
+			addr2str_r(&conn->next_hop, ch_str, RIMEADDR_STRING_LENGTH)
+		);
+
+		forward(conn);
 	}
 }
 
 static const struct runicast_callbacks callbacks_forward = { &recv_runicast, &sent_runicast, &timedout_runicast };
 
-/** The function that will be executed when a mesh message is received */
-static void recv_mesh(struct mesh_conn * ptr, rimeaddr_t const * originator, uint8_t hops)
-{
-	cluster_conn_t * conn = conncvt_mesh(ptr);
-	
-	// A cluster head has received a data message from
-	// a member of its cluster.
-	// We now need to forward it onto the sink.
-	
-	if (conn->cluster_depth == 0)
-	{
-		leds_on(LEDS_BLUE);
-	}
-	
-	char originator_str[RIMEADDR_STRING_LENGTH];
-	char current_str[RIMEADDR_STRING_LENGTH];
-	char ch_str[RIMEADDR_STRING_LENGTH];
-
-	printf("Forwarding: from:%s via:%s to:%s\n",
-		addr2str_r(originator, originator_str, RIMEADDR_STRING_LENGTH),
-		addr2str_r(&rimeaddr_node_addr, current_str, RIMEADDR_STRING_LENGTH),
-		addr2str_r(&conn->our_cluster_head, ch_str, RIMEADDR_STRING_LENGTH)
-	);
-
-	if (conn->best_hop == 0)
-	{
-		// Include the originator in the header
-		rimeaddr_t * source = (rimeaddr_t *)(((char *)packetbuf_dataptr()) + packetbuf_datalen());
-		packetbuf_set_datalen(packetbuf_datalen() + sizeof(rimeaddr_t));
-		rimeaddr_copy(source, originator);
-
-		runicast_send(&conn->rc, &conn->our_cluster_head, MAX_RUNICAST_RETX);
-	}
-	else
-	{
-		mesh_send(&conn->mc, &conn->our_cluster_head);
-	}
-}
-
-static void mesh_sent(struct mesh_conn * c) {}
-static void mesh_timedout(struct mesh_conn * c) {}
 
-static const struct mesh_callbacks callbacks_data = { &recv_mesh, &mesh_sent, &mesh_timedout };
-
-
 /** The function that will be executed when a message is received */
 static void recv_setup(struct stbroadcast_conn * ptr)
 {
@@ -285,6 +1030,10 @@ static void recv_setup(struct stbroadcast_conn * ptr)
 		return;
 	}
 
+	// Remember our neighbours' offers in case we need to route
+	// through one of them after taking over as cluster head
+	update_neighbour(conn, &msg->source, &msg->head, msg->hop_count);
+
 	// If this is the first setup message that we have seen
 	// Then we need to start the collect timeout
 	if (!conn->has_seen_setup)
@@ -292,8 +1041,10 @@ static void recv_setup(struct stbroadcast_conn * ptr)
 		conn->has_seen_setup = true;
 		
 		conn->collecting_best_level = msg->head_level;
-		conn->collecting_best_CH = msg->head;
-		conn->collecting_best_hop = msg->hop_count;
+		conn->collecting_best_CH = msg->head;
+		conn->collecting_best_hop = msg->hop_count;
+		conn->collecting_best_depth = msg->cluster_depth;
+		rimeaddr_copy(&conn->collecting_next_hop, &msg->source);
 
 		// Indicate that we are looking for best parent
 		leds_on(LEDS_RED);
@@ -319,8 +1070,10 @@ static void recv_setup(struct stbroadcast_conn * ptr)
 
 		// Set the best parent, and the level of that node
 		rimeaddr_copy(&conn->collecting_best_CH, &msg->head);
+		rimeaddr_copy(&conn->collecting_next_hop, &msg->source);
 		conn->collecting_best_level = msg->head_level;
 		conn->collecting_best_hop = msg->hop_count;
+		conn->collecting_best_depth = msg->cluster_depth;
 	}
 
 }
@@ -353,6 +1106,7 @@ static void CH_setup_wait_finished(void * ptr)
 	rimeaddr_copy(&msg->head, &rimeaddr_node_addr);
 	msg->head_level = conn->our_level;
 	msg->hop_count = conn->cluster_depth;
+	msg->cluster_depth = conn->cluster_depth;
 
 	stbroadcast_send_stubborn(&conn->bc, STUBBORN_INTERVAL);
 
@@ -364,19 +1118,63 @@ static void CH_setup_wait_finished(void * ptr)
 }
 
 
+/** Called when a batch of readings is ready to be sent to our cluster head */
+static void send_batch(void * ptr)
+{
+	cluster_conn_t * conn = (cluster_conn_t *)ptr;
+
+	if (!frame_prepend(&rimeaddr_node_addr, conn->epoch++))
+	{
+		printf("No space for the frame header\n");
+		return;
+	}
+
+	send_to_head(conn);
+}
+
+
 bool cluster_open(cluster_conn_t * conn, rimeaddr_t const * sink,
                   uint16_t ch1, uint16_t ch2, uint16_t ch3,
-                  unsigned int cluster_depth, cluster_callbacks_t const * callbacks)
+                  unsigned int cluster_depth, size_t data_size,
+                  cluster_callbacks_t const * callbacks)
 {
 	if (conn != NULL && sink != NULL &&
 		callbacks != NULL && callbacks->recv != NULL && callbacks->setup_complete != NULL)
 	{
+		// Space is left in each packet for the frame header.
+		// By default readings are sent as soon as they are generated.
+		if (!batch_init(&conn->batch, data_size, sizeof(frame_header_t), 0, &send_batch, conn))
+		{
+			return false;
+		}
+
+		conn->data_length = data_size;
+		conn->data = NULL;
+		conn->is_collecting = false;
+		conn->epoch = 0;
+
+		// Only need space for a summary if we are asked to aggregate
+		if (callbacks->aggregate_update != NULL)
+		{
+			conn->data = malloc(data_size);
+
+			if (conn->data == NULL)
+			{
+				return false;
+			}
+		}
+
 		stbroadcast_open(&conn->bc, ch1, &callbacks_setup);
-		mesh_open(&conn->mc, ch2, &callbacks_data);
-		runicast_open(&conn->rc, ch3, &callbacks_forward);
+		runicast_open(&conn->rc, ch2, &callbacks_forward);
+		broadcast_open(&conn->rotation_bc, ch3, &callbacks_rotation);
 
 		rimeaddr_copy(&conn->our_cluster_head, &rimeaddr_null);
 		rimeaddr_copy(&conn->collecting_best_CH, &rimeaddr_null);
+		rimeaddr_copy(&conn->next_hop, &rimeaddr_null);
+		rimeaddr_copy(&conn->collecting_next_hop, &rimeaddr_null);
+		memset(conn->neighbours, 0, sizeof(conn->neighbours));
+
+		conn->forward_queue_length = 0;
 
 		rimeaddr_copy(&conn->sink, sink);
 
@@ -389,6 +1187,23 @@ bool cluster_open(cluster_conn_t * conn, rimeaddr_t const * sink,
 		conn->is_CH = false;
 
 		conn->cluster_depth = cluster_depth;
+		conn->collecting_best_depth = cluster_depth;
+		conn->target_cluster_size = 0;
+
+		memset(conn->density_replies, 0, sizeof(conn->density_replies));
+		conn->density_reply_count = 0;
+		conn->is_probing_density = false;
+		conn->is_density_reply_pending = false;
+
+		conn->forwarded = 0;
+		conn->last_rotation = 0;
+		conn->is_electing = false;
+		rimeaddr_copy(&conn->best_candidate, &rimeaddr_null);
+		conn->best_candidate_score = 0;
+		rimeaddr_copy(&conn->claim_head, &rimeaddr_null);
+		conn->claim_score = 0;
+		conn->is_handing_over = false;
+		conn->handover_attempts = 0;
 
 		memcpy(&conn->callbacks, callbacks, sizeof(cluster_callbacks_t));
 
@@ -412,8 +1227,26 @@ void cluster_close(cluster_conn_t * conn)
 	if (conn != NULL)
 	{
 		stbroadcast_close(&conn->bc);
-		mesh_close(&conn->mc);
 		runicast_close(&conn->rc);
+		broadcast_close(&conn->rotation_bc);
+
+		ctimer_stop(&conn->claim_ct);
+		ctimer_stop(&conn->handover_ct);
+		ctimer_stop(&conn->forward_retry_ct);
+		ctimer_stop(&conn->density_reply_ct);
+
+		batch_clear(&conn->batch);
+
+		while (conn->forward_queue_length != 0)
+		{
+			queuebuf_free(conn->forward_queue[--conn->forward_queue_length]);
+		}
+
+		if (conn->data != NULL)
+		{
+			free(conn->data);
+			conn->data = NULL;
+		}
 	}
 }
 
@@ -431,25 +1264,39 @@ void cluster_send(cluster_conn_t * conn)
 			// We are the sink, so just call the receive function
 			(*conn->callbacks.recv)(conn, &rimeaddr_node_addr);
 		}
-		else if (conn->best_hop==0)
+		else if (is_aggregating(conn))
 		{
-			// The node is within range of its clusterhead/sink, so use runicast
-		
-			// Include the originator in the header
-			rimeaddr_t * source = (rimeaddr_t *)(((char *)packetbuf_dataptr()) + packetbuf_datalen());
-			packetbuf_set_datalen(packetbuf_datalen() + sizeof(rimeaddr_t));
-			rimeaddr_copy(source, &rimeaddr_node_addr);
-
-			runicast_send(&conn->rc, &conn->our_cluster_head, MAX_RUNICAST_RETX);
+			// Our own reading is part of the cluster's summary
+			aggregate_reading(conn, packetbuf_dataptr());
 		}
 		else
 		{
-			// Otherwise just use mesh to send the message to the CH
-			mesh_send(&conn->mc, &conn->our_cluster_head);
+			// Readings are batched together and sent once
+			// the batch is full or has waited long enough
+			batch_add(&conn->batch, packetbuf_dataptr());
 		}
 	}
 }
 
+void cluster_set_target_size(cluster_conn_t * conn, unsigned int size)
+{
+	if (conn != NULL)
+	{
+		conn->target_cluster_size = size;
+	}
+}
+
+void cluster_set_batch_wait(cluster_conn_t * conn, clock_time_t wait)
+{
+	if (conn != NULL)
+	{
+		// Send anything waiting under the old setting
+		batch_flush(&conn->batch);
+
+		conn->batch.wait = wait;
+	}
+}
+
 
 /********************************************
  ********* APPLICATION BEGINS HERE **********
@@ -463,8 +1310,9 @@ AUTOSTART_PROCESSES(&startup_process);
 
 typedef struct
 {
-	double temperature;
-	double humidity;
+	// Raw readings are sent, conversion is done at the sink.
+	// Cluster heads average the readings of their members.
+	sensor_mean_t mean;
 } collect_msg_t;
 
 
@@ -472,9 +1320,12 @@ static void cluster_recv(cluster_conn_t * conn, rimeaddr_t const * source)
 {
 	collect_msg_t const * msg = (collect_msg_t const *)packetbuf_dataptr();
 
-	printf("Sink rcv: Src:%s Temp:%d Hudmid:%d%%\n",
+	int16_t temperature = sht11_temperature_centi(msg->mean.raw.temperature);
+	int16_t humidity = sht11_relative_humidity_compensated_centi(msg->mean.raw.humidity, temperature);
+
+	printf("Sink rcv: Src:%s Temp:%d Hudmid:%d%% Count:%u\n",
 			addr2str(source),
-			(int)msg->temperature, (int)msg->humidity
+			temperature / 100, humidity / 100, msg->mean.count
 	);
 }
 
@@ -486,8 +1337,17 @@ static void cluster_setup_finished(cluster_conn_t * conn)
 	}
 }
 
+static void cluster_aggregate_update(void * data, void const * to_apply)
+{
+	collect_msg_t * our_data = (collect_msg_t *)data;
+	collect_msg_t const * data_to_apply = (collect_msg_t const *)to_apply;
+
+	sensor_mean_merge(&our_data->mean, &data_to_apply->mean);
+}
+
 static cluster_conn_t conn;
-static cluster_callbacks_t callbacks = { &cluster_recv, &cluster_setup_finished };
+static cluster_callbacks_t callbacks =
+	{ &cluster_recv, &cluster_setup_finished, &cluster_aggregate_update };
 
 PROCESS_THREAD(startup_process, ev, data)
 {
@@ -498,15 +1358,28 @@ PROCESS_THREAD(startup_process, ev, data)
 	sink.u8[0] = 1;
 	sink.u8[1] = 0;
 
-	cluster_open(&conn, &sink, 118, 132, 147, 2, &callbacks);
+	// This fails when a reading and the frame header
+	// do not fit in a single frame
+	if (!cluster_open(&conn, &sink, 118, 132, 147, 2, sizeof(collect_msg_t), &callbacks))
+	{
+		printf("Failed to open the cluster, a reading is %u bytes\n",
+			(unsigned)sizeof(collect_msg_t));
+		PROCESS_EXIT();
+	}
+
+	// Readings are only generated every minute, so wait
+	// a while to send several in a single packet.
+	cluster_set_batch_wait(&conn, 5 * 60 * CLOCK_SECOND);
+
+	// Let each cluster head pick a depth that gives it
+	// roughly this many nodes, rather than always using 2.
+	cluster_set_target_size(&conn, 10);
 
 	PROCESS_END();
 }
 
 PROCESS_THREAD(send_data_process, ev, data)
 {
-	static struct etimer et;
-
 	PROCESS_BEGIN();
 
 	if (!is_sink(&conn))
@@ -515,35 +1388,25 @@ PROCESS_THREAD(send_data_process, ev, data)
 
 		leds_on(LEDS_GREEN);
 
-		// Send every minute.
-		etimer_set(&et, 60 * CLOCK_SECOND);
+		// Read the sensors and send every minute.
+		sensor_sampler_start(60 * CLOCK_SECOND);
 	 
 		while (true)
 		{
-			PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
-
-			// Read the data from the temp and humidity sensors
-			SENSORS_ACTIVATE(sht11_sensor);
-			unsigned raw_temperature = sht11_sensor.value(SHT11_SENSOR_TEMP);
-			unsigned raw_humidity = sht11_sensor.value(SHT11_SENSOR_HUMIDITY);
-			SENSORS_DEACTIVATE(sht11_sensor);
-
-			double temperature = sht11_temperature(raw_temperature);
-			double humidity = sht11_relative_humidity_compensated(raw_humidity, temperature);
+			PROCESS_WAIT_EVENT_UNTIL(ev == sensor_sampler_event);
 
+			sensor_reading_t const * reading = (sensor_reading_t const *)data;
 
 			// Create the data message that we are going to send
 			packetbuf_clear();
 			packetbuf_set_datalen(sizeof(collect_msg_t));
-			collect_msg_t * msg = (collect_msg_t *)packetbuf_dataptr();
+			debug_packet_size(sizeof(collect_msg_t));
+			collect_msg_t * msg = (collect_msg_t *)packetbuf_dataptr();
 			memset(msg, 0, sizeof(collect_msg_t));
 
-			msg->temperature = temperature;
-			msg->humidity = humidity;
-			
-			cluster_send(&conn);
+			sensor_mean_init(&msg->mean, &reading->raw);
 
-			etimer_reset(&et);
+			cluster_send(&conn);
 		}
 	}
 	
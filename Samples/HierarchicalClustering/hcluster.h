@@ -1,12 +1,35 @@
 #ifndef CS407_HCLUSTER_H
 #define CS407_HCLUSTER_H
 
+#include "net/rime/broadcast.h"
 #include "net/rime/stbroadcast.h"
 #include "net/rime/runicast.h"
-#include "net/rime/mesh.h"
+
+#include "batch-buffer.h"
 
 struct cluster_conn;
 
+#define CLUSTER_MAX_NEIGHBOURS 8
+
+// The number of distinct neighbours that can be told apart when
+// estimating density, this is much larger than the neighbour table
+#define CLUSTER_DENSITY_BITS 256
+
+// The number of packets that can wait for the runicast to be
+// free, each one uses a queuebuf until it is sent
+#define CLUSTER_FORWARD_QUEUE_SIZE 4
+
+/** A neighbour we have heard a setup message from */
+typedef struct
+{
+	rimeaddr_t addr;
+
+	// The cluster head the neighbour offered and its hops from it
+	rimeaddr_t head;
+	unsigned int hop_count;
+
+} cluster_neighbour_t;
+
 typedef struct
 {
 	/** The function called when a message is received at the sink.
@@ -15,14 +38,19 @@ typedef struct
 
 	/** This function is called when a node has finished setting up */
 	void (* setup_complete)(struct cluster_conn * conn);
+
+	/** Optional, when set cluster heads merge the readings of their members
+		and only send a summary to their own cluster head once per window.
+		The first argument is the summary, the second is the reading to merge. */
+	void (* aggregate_update)(void * data, void const * to_apply);
 } cluster_callbacks_t;
 
 typedef struct cluster_conn
 {
 	// DO NOT CHANGE CONNECTION ORDER!!!
 	struct stbroadcast_conn bc;
-	struct mesh_conn mc;
 	struct runicast_conn rc;
+	struct broadcast_conn rotation_bc;
 
 	bool has_seen_setup;
 	bool is_CH;
@@ -30,6 +58,13 @@ typedef struct cluster_conn
 	rimeaddr_t our_cluster_head;
 	rimeaddr_t collecting_best_CH;
 
+	// The neighbour that made the best setup offer, data
+	// is sent hop by hop through it to our cluster head
+	rimeaddr_t next_hop;
+	rimeaddr_t collecting_next_hop;
+
+	cluster_neighbour_t neighbours[CLUSTER_MAX_NEIGHBOURS];
+
 	rimeaddr_t sink;
 
 	unsigned int best_hop;
@@ -39,7 +74,70 @@ typedef struct cluster_conn
 	unsigned int our_level;
 	unsigned int collecting_best_level;
 
+	// The number of hops our cluster reaches, and the
+	// depth of the cluster we are joining
 	unsigned int cluster_depth;
+	unsigned int collecting_best_depth;
+
+	// The number of nodes cluster heads aim to have in their
+	// cluster, 0 uses the same cluster depth everywhere
+	unsigned int target_cluster_size;
+
+	// A bitmap of the hashed addresses of the neighbours that replied
+	// to our density probe, and how many there are. This gives the
+	// density used to pick our cluster depth.
+	uint8_t density_replies[CLUSTER_DENSITY_BITS / 8];
+	unsigned int density_reply_count;
+	bool is_probing_density;
+
+	// Our reply to a neighbour's density probe
+	bool is_density_reply_pending;
+	struct ctimer density_reply_ct;
+
+	// The size of the user's data
+	size_t data_length;
+
+	// The summary of our members' readings
+	// when aggregating as a cluster head
+	void * data;
+	bool is_collecting;
+
+	// Incremented for each batch of our own we send
+	uint8_t epoch;
+
+	// Readings waiting to be sent to our cluster head
+	batch_buffer_t batch;
+
+	// Packets waiting to be sent on to our next hop
+	// while the runicast is busy, oldest first
+	struct queuebuf * forward_queue[CLUSTER_FORWARD_QUEUE_SIZE];
+	uint8_t forward_queue_length;
+
+	// Retries sending the queue when the runicast refused a packet
+	struct ctimer forward_retry_ct;
+
+	// The number of packets we have forwarded or merged
+	// since we last took part in a cluster head rotation
+	unsigned int forwarded;
+
+	// When the cluster head role was last rotated, in seconds
+	unsigned long last_rotation;
+
+	// The best candidate to replace us as cluster head
+	bool is_electing;
+	rimeaddr_t best_candidate;
+	uint16_t best_candidate_score;
+
+	// We stay cluster head while handing over, until
+	// the new head acknowledges by resending the handover
+	bool is_handing_over;
+	uint8_t handover_attempts;
+	struct ctimer handover_ct;
+
+	// Our pending claim to become cluster head
+	struct ctimer claim_ct;
+	rimeaddr_t claim_head;
+	uint16_t claim_score;
 
 	cluster_callbacks_t callbacks;
 
@@ -49,11 +147,21 @@ typedef struct cluster_conn
 
 bool cluster_open(cluster_conn_t * conn, rimeaddr_t const * sink,
                   uint16_t ch1, uint16_t ch2, uint16_t ch3,
-                  unsigned int cluster_depth, cluster_callbacks_t const * callbacks);
+                  unsigned int cluster_depth, size_t data_size,
+                  cluster_callbacks_t const * callbacks);
 
 void cluster_close(cluster_conn_t * conn);
 
 void cluster_send(cluster_conn_t * conn);
 
+// Set the number of nodes cluster heads should aim to have in their
+// cluster. Each head picks its cluster depth from how many neighbours
+// reply when it probes for them. Must be called before setup starts.
+void cluster_set_target_size(cluster_conn_t * conn, unsigned int size);
+
+// Set how long readings may wait to be sent together in
+// one packet, a wait of 0 sends each reading immediately.
+void cluster_set_batch_wait(cluster_conn_t * conn, clock_time_t wait);
+
 #endif /*CS407_HCLUSTER_H*/
 
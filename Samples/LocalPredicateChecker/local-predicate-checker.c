@@ -8,6 +8,8 @@
 #include "dev/sht11.h"
 #include "dev/sht11-sensor.h"
 
+#include "dev/serial-line.h"
+
 #include "net/netstack.h"
 #include "net/rime.h"
 #include "net/rime/mesh.h"
@@ -16,12 +18,29 @@
 
 #include "../Common/sensor-converter-broken.h"
 #include "../Common/debug-helper.h"
+#include "../Common/batch-buffer.h"
+#include "../Common/sensor-sampler.h"
 #include "predicate-checker.h"
+#include "predicate-service.h"
 
 
 
+// The longest text a violation is turned back into at the sink
 #define ERROR_MESSAGE_MAX_LENGTH 96
 
+// How often the sensors are read, and how old a reading
+// can be when it is compared with a neighbour's
+static const clock_time_t SAMPLE_PERIOD = 20 * CLOCK_SECOND;
+static const unsigned long SAMPLE_MAX_AGE = 20;
+
+// How often each node pushes its data to its neighbours, well within
+// the time neighbour data is kept so a lost beacon or two is fine.
+// Set to 0 to have 1-hop checks request the data instead.
+static const clock_time_t BEACON_PERIOD = 60 * CLOCK_SECOND;
+
+// How often a predicate program received over the network is evaluated
+static const clock_time_t PROGRAM_PERIOD = 60 * CLOCK_SECOND;
+
 static struct mesh_conn mc;
 
 // This is the address of the node we are sending
@@ -51,141 +70,234 @@ typedef struct
 	uint8_t type;
 } base_msg_t;
 
-/** The structure of the message we are sending */
+/** The structure of each reading we are sending. Collect messages
+	are a base_msg_t followed by a batch of these readings. */
 typedef struct
 {
-	base_msg_t base;
-
 	// True if a predicate was violated
 	bool pred_violated;
 
-	double temperature;
-	double humidity;
+	// In hundredths of a degree and a percent
+	int16_t temperature;
+	int16_t humidity;
 
 } collect_msg_t;
 
+typedef enum
+{
+	temperature_predicate,
+	humidity_predicate,
+	neighbour_humidity_predicate,
+	neighbour_temperature_predicate,
+	program_predicate
+} predicate_id_t;
+
+/** A predicate violation, the sink turns this back into text */
 typedef struct
 {
 	base_msg_t base;
 
-	// The error message containing predicate
-	// failure details
-	char contents[ERROR_MESSAGE_MAX_LENGTH];
+	// This is a predicate_id_t, but a uint8_t is
+	// used for message size optimisation
+	uint8_t predicate_id;
 
-	// The length of the string in contents
-	size_t length;
+	// The reading the violation was found in
+	uint8_t epoch;
 
-} error_msg_t;
+	// The node whose data broke the predicate
+	rimeaddr_t node;
 
+	// The values involved, in hundredths
+	int16_t values[2];
 
-static bool temperature_validator(void const * value)
-{
-	double temperature = *(double const *)value;
+} violation_msg_t;
 
-	return temperature > 0 && temperature <= 40;
-}
+// Counts the readings this node has taken
+static uint8_t epoch = 0;
 
-static void temperature_message(void const * value)
+static void send_violation(predicate_id_t id, rimeaddr_t const * node, int16_t value1, int16_t value2)
 {
-	double temperature = *(double const *)value;
-
 	packetbuf_clear();
-	packetbuf_set_datalen(sizeof(error_msg_t));
-	debug_packet_size(sizeof(error_msg_t));
-	error_msg_t * msg = (error_msg_t *)packetbuf_dataptr();
-	memset(msg, 0, sizeof(error_msg_t));
+	packetbuf_set_datalen(sizeof(violation_msg_t));
+	debug_packet_size(sizeof(violation_msg_t));
+	violation_msg_t * msg = (violation_msg_t *)packetbuf_dataptr();
+	memset(msg, 0, sizeof(violation_msg_t));
 
 	msg->base.type = error_message_type;
+	msg->predicate_id = id;
+	msg->epoch = epoch;
+	rimeaddr_copy(&msg->node, node);
+	msg->values[0] = value1;
+	msg->values[1] = value2;
+
+	printf("Sending violation of predicate %u about %s\n", id, addr2str(node));
 
-	msg->length = snprintf(msg->contents,
-		ERROR_MESSAGE_MAX_LENGTH,
-		"P(T) : (0 < T <= 40) FAILED where T=%d",
-		(int)temperature);
-	
 	mesh_send(&mc, &destination);
 }
 
-static bool humidity_validator(void const * value)
+/** Reproduces the text of a violation at the sink */
+static void violation_to_string(violation_msg_t const * msg, char * text, size_t length)
 {
-	double humidity = *(double const *)value;
+	int value1 = msg->values[0] / 100;
+	int value2 = msg->values[1] / 100;
+
+	switch (msg->predicate_id)
+	{
+		case temperature_predicate:
+			snprintf(text, length, "P(T) : (0 < T <= 40) FAILED where T=%d", value1);
+			break;
+
+		case humidity_predicate:
+			snprintf(text, length, "P(H) : (0 < H <= 100) FAILED where H=%d%%", value1);
+			break;
+
+		case neighbour_humidity_predicate:
+			snprintf(text, length, "P1(H) : (|Ho-H1| <= 10) FAILED where Ho=%d%% H1=%d%%", value1, value2);
+			break;
 
-	return humidity > 0 && humidity <= 100;
+		case neighbour_temperature_predicate:
+			snprintf(text, length, "P1(T) : (|To-T1| <= 5) FAILED where To=%d T1=%d", value1, value2);
+			break;
+
+		case program_predicate:
+			snprintf(text, length, "Predicate program version %d FAILED", msg->values[0]);
+			break;
+
+		default:
+			snprintf(text, length, "Unknown predicate %u FAILED", msg->predicate_id);
+			break;
+	}
 }
 
-static void humidity_message(void const * value)
+
+// Readings are in hundredths of a degree and a percent
+static bool temperature_validator(void const * value)
 {
-	double humidity = *(double const *)value;
+	int16_t temperature = *(int16_t const *)value;
 
-	packetbuf_clear();
-	packetbuf_set_datalen(sizeof(error_msg_t));
-	debug_packet_size(sizeof(error_msg_t));
-	error_msg_t * msg = (error_msg_t *)packetbuf_dataptr();
-	memset(msg, 0, sizeof(error_msg_t));
+	return temperature > 0 && temperature <= 4000;
+}
 
-	msg->base.type = error_message_type;
+static void temperature_message(void const * value)
+{
+	int16_t temperature = *(int16_t const *)value;
+
+	send_violation(temperature_predicate, &rimeaddr_node_addr, temperature, 0);
+}
 
-	msg->length = snprintf(msg->contents,
-		ERROR_MESSAGE_MAX_LENGTH,
-		"P(H) : (0 < H <= 100) FAILED where H=%d%%",
-		(int)humidity);
+static bool humidity_validator(void const * value)
+{
+	int16_t humidity = *(int16_t const *)value;
 
-	printf("Sending error message about humidity on %s: %s (%u)\n",
-		addr2str(&rimeaddr_node_addr),
-		msg->contents, msg->length);
+	return humidity > 0 && humidity <= 10000;
+}
 
-	mesh_send(&mc, &destination);
+static void humidity_message(void const * value)
+{
+	int16_t humidity = *(int16_t const *)value;
+
+	send_violation(humidity_predicate, &rimeaddr_node_addr, humidity, 0);
 }
 
 
 static bool neighbour_humidity_validator(data_t const * value, rimeaddr_t const * sender)
 {
-	// Read raw sensor data
-	SENSORS_ACTIVATE(sht11_sensor);
-	unsigned raw_temperature = sht11_sensor.value(SHT11_SENSOR_TEMP);
-	unsigned raw_humidity = sht11_sensor.value(SHT11_SENSOR_HUMIDITY);
-	SENSORS_DEACTIVATE(sht11_sensor);
-
-	// Convert to human understandable values
-	double temperature = sht11_temperature(raw_temperature);
-	double humidity = sht11_relative_humidity_compensated(raw_humidity, temperature);
+	int16_t humidity = sensor_sampler_get(SAMPLE_MAX_AGE)->humidity;
 
 	// Neighbour's humidity is within 10 of ours
-	return abs(humidity - value->humidity) <= 10;
+	return abs(humidity - value->humidity) <= 1000;
 }
 
 static void neighbour_humidity_message(data_t const * value, rimeaddr_t const * sender)
 {
-	// Read raw sensor data
-	SENSORS_ACTIVATE(sht11_sensor);
-	unsigned raw_temperature = sht11_sensor.value(SHT11_SENSOR_TEMP);
-	unsigned raw_humidity = sht11_sensor.value(SHT11_SENSOR_HUMIDITY);
-	SENSORS_DEACTIVATE(sht11_sensor);
+	// The same reading the validator used
+	int16_t humidity = sensor_sampler_get(SAMPLE_MAX_AGE)->humidity;
+
+	send_violation(neighbour_humidity_predicate, sender, humidity, value->humidity);
+}
+
+static bool neighbour_temperature_validator(data_t const * value, rimeaddr_t const * sender)
+{
+	int16_t temperature = sensor_sampler_get(SAMPLE_MAX_AGE)->temperature;
+
+	// Neighbour's temperature is within 5 of ours
+	return abs(temperature - value->temperature) <= 500;
+}
 
-	// Convert to human understandable values
-	double temperature = sht11_temperature(raw_temperature);
-	double humidity = sht11_relative_humidity_compensated(raw_humidity, temperature);
+static void neighbour_temperature_message(data_t const * value, rimeaddr_t const * sender)
+{
+	// The same reading the validator used
+	int16_t temperature = sensor_sampler_get(SAMPLE_MAX_AGE)->temperature;
 
+	send_violation(neighbour_temperature_predicate, sender, temperature, value->temperature);
+}
 
+static void predicate_program_message(uint8_t version)
+{
 	packetbuf_clear();
-	packetbuf_set_datalen(sizeof(error_msg_t));
-	debug_packet_size(sizeof(error_msg_t));
-	error_msg_t * msg = (error_msg_t *)packetbuf_dataptr();
-	memset(msg, 0, sizeof(error_msg_t));
+	packetbuf_set_datalen(sizeof(violation_msg_t));
+	debug_packet_size(sizeof(violation_msg_t));
+	violation_msg_t * msg = (violation_msg_t *)packetbuf_dataptr();
+	memset(msg, 0, sizeof(violation_msg_t));
 
 	msg->base.type = error_message_type;
+	msg->predicate_id = program_predicate;
+	msg->epoch = epoch;
+	rimeaddr_copy(&msg->node, &rimeaddr_node_addr);
 
-	msg->length = snprintf(msg->contents,
-		ERROR_MESSAGE_MAX_LENGTH,
-		"P1(H) : (|Ho-H1| <= 10) FAILED where Ho=%d%% H1=%d%%",
-		(int)humidity, (int)value->humidity);
-
-	printf("Sending error message about 1-hop humidity on %s: %s (%u)\n",
-		addr2str(&rimeaddr_node_addr),
-		msg->contents, msg->length);
+	// The version is sent as it is, not in hundredths
+	msg->values[0] = version;
 
 	mesh_send(&mc, &destination);
 }
 
+// Programs compiled by Dragon are given to the sink over its serial line
+// in hex, a few bytes per "load <hex>" line, then "install <version>"
+// installs them and spreads them to the rest of the network.
+static uint8_t staged_program[PREDICATE_PROGRAM_MAX];
+static uint16_t staged_length = 0;
+
+static int8_t hex_value(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+static void serial_line_command(char const * line)
+{
+	if (strncmp(line, "load ", 5) == 0)
+	{
+		char const * hex;
+		for (hex = line + 5; hex[0] != '\0' && hex[1] != '\0'; hex += 2)
+		{
+			int8_t high = hex_value(hex[0]);
+			int8_t low = hex_value(hex[1]);
+
+			if (high < 0 || low < 0 || staged_length == PREDICATE_PROGRAM_MAX)
+			{
+				printf("Bad predicate program, discarding it\n");
+				staged_length = 0;
+				return;
+			}
+
+			staged_program[staged_length++] = (uint8_t)((high << 4) | low);
+		}
+
+		printf("Loaded %u bytes of predicate program\n", staged_length);
+	}
+	else if (strncmp(line, "install ", 8) == 0)
+	{
+		predicate_service_install(staged_program, staged_length, (uint8_t)atoi(line + 8));
+		staged_length = 0;
+	}
+	else
+	{
+		printf("Unknown command: %s\n", line);
+	}
+}
+
 
 
 /** The function that will be executed when a message is received */
@@ -197,23 +309,47 @@ static void recv(struct mesh_conn * c, rimeaddr_t const * from, uint8_t hops)
 	{
 		case collect_message_type:
 		{
-			collect_msg_t const * msg = (collect_msg_t const *)bmsg;
+			packetbuf_hdrreduce(sizeof(base_msg_t));
 
-			printf("Network Data: Addr:%s Hops:%u Temp:%d Hudmid:%d%% Vio:%s\n",
-				addr2str(from),
-				hops,
-				(int)msg->temperature, (int)msg->humidity,
-				msg->pred_violated ? "True" : "False"
-			);
+			uint8_t count = batch_unpack_begin(sizeof(collect_msg_t));
+
+			uint8_t i;
+			for (i = 0; i != count; ++i)
+			{
+				collect_msg_t const * msg = (collect_msg_t const *)packetbuf_dataptr();
+
+				printf("Network Data: Addr:%s Hops:%u Temp:%d Hudmid:%d%% Vio:%s\n",
+					addr2str(from),
+					hops,
+					msg->temperature / 100, msg->humidity / 100,
+					msg->pred_violated ? "True" : "False"
+				);
+
+				batch_unpack_next(sizeof(collect_msg_t));
+			}
 		} break;
 
 		case error_message_type:
 		{
-			error_msg_t const * msg = (error_msg_t const *)bmsg;
+			if (packetbuf_datalen() < sizeof(violation_msg_t))
+			{
+				printf("Error message too short Addr:%s\n", addr2str(from));
+				break;
+			}
+
+			violation_msg_t const * msg = (violation_msg_t const *)bmsg;
 
-			printf("Error occured on %s Hops:%u: %s\n",
+			char text[ERROR_MESSAGE_MAX_LENGTH];
+			violation_to_string(msg, text, sizeof(text));
+
+			// addr2str uses one buffer, so print the addresses separately
+			printf("Error occured on %s Hops:%u Epoch:%u ",
 				addr2str(from),
-				hops, msg->contents
+				hops, msg->epoch
+			);
+
+			printf("Node:%s: %s\n",
+				addr2str(&msg->node), text
 			);
 
 		} break;
@@ -243,67 +379,108 @@ static void timeout(struct mesh_conn * c)
 }
 
 static const struct mesh_callbacks callbacks = { &recv, &sent, &timeout };
+
+
+// Readings are batched together to reduce the number of packets sent
+static batch_buffer_t collect_batch;
+
+/** Called when a batch of readings is ready to be sent */
+static void send_collect_batch(void * ptr)
+{
+	// Mark the batch as containing collect messages
+	if (!packetbuf_hdralloc(sizeof(base_msg_t)))
+	{
+		printf("No space for the message type\n");
+		return;
+	}
+
+	base_msg_t * bmsg = (base_msg_t *)packetbuf_hdrptr();
+	bmsg->type = collect_message_type;
+
+	mesh_send(&mc, &destination);
+}
  
 PROCESS(data_collector_process, "Data Collector");
 PROCESS(predicate_checker_process, "Predicate Checker");
 
-AUTOSTART_PROCESSES(&data_collector_process/*, &predicate_checker_process*/);
+AUTOSTART_PROCESSES(&data_collector_process, &predicate_checker_process);
  
 PROCESS_THREAD(data_collector_process, ev, data)
 {
-	static struct etimer et;
+	// The data the local predicates were last checked against, and
+	// their results. They are only checked again when it changes.
+	static data_t checked;
+	static bool has_checked = false;
+	static bool temperature_ok;
+	static bool humidity_ok;
 
 	PROCESS_EXITHANDLER(goto exit;)
 	PROCESS_BEGIN();
 
 	mesh_open(&mc, 147, &callbacks);
 
+	// Readings are generated every 20 seconds, so
+	// wait up to 2 minutes to send them together.
+	// Space is left in each packet for the message type.
+	batch_init(&collect_batch, sizeof(collect_msg_t), sizeof(base_msg_t),
+		120 * CLOCK_SECOND, &send_collect_batch, NULL);
+
 	// Set to be the sink if the address is 1.0
 	memset(&destination, 0, sizeof(rimeaddr_t));
 	destination.u8[sizeof(rimeaddr_t) - 2] = 1;
 
 	// Generate data every 20 seconds
-	etimer_set(&et, 20 * CLOCK_SECOND);
+	sensor_sampler_start(SAMPLE_PERIOD);
  
 	while (true)
 	{
-		PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
-
-		// Read raw sensor data
-		SENSORS_ACTIVATE(sht11_sensor);
-		unsigned raw_temperature = sht11_sensor.value(SHT11_SENSOR_TEMP);
-		unsigned raw_humidity = sht11_sensor.value(SHT11_SENSOR_HUMIDITY);
-		SENSORS_DEACTIVATE(sht11_sensor);
-
-		// Convert to human understandable values
-		double temperature = sht11_temperature(raw_temperature);
-		double humidity = sht11_relative_humidity_compensated(raw_humidity, temperature);
-
-		bool violated = false;
-
-		// Check predicates
-		violated |= check_predicate(&temperature_validator, &temperature_message, &temperature);
-		violated |= check_predicate(&humidity_validator, &humidity_message, &humidity);
-
-		// Send data message
-		packetbuf_clear();
-		packetbuf_set_datalen(sizeof(collect_msg_t));
-		debug_packet_size(sizeof(collect_msg_t));
-		collect_msg_t * msg = (collect_msg_t *)packetbuf_dataptr();
-		memset(msg, 0, sizeof(collect_msg_t));
-
-		msg->base.type = collect_message_type;
-		msg->temperature = temperature;
-		msg->humidity = humidity;
-		msg->pred_violated = violated;
-	
-		mesh_send(&mc, &destination);
+		PROCESS_WAIT_EVENT_UNTIL(ev == sensor_sampler_event);
+
+		sensor_reading_t const * reading = (sensor_reading_t const *)data;
+
+		++epoch;
+
+		int16_t temperature = reading->temperature;
+		int16_t humidity = reading->humidity;
+
+		data_t current = { temperature, humidity };
+
+		uint8_t changed = has_checked
+			? data_changed_fields(&checked, &current)
+			: DATA_FIELD_TEMPERATURE | DATA_FIELD_HUMIDITY;
+
+		has_checked = true;
 
-		etimer_reset(&et);
+		// Check predicates whose data has changed
+		if ((changed & DATA_FIELD_TEMPERATURE) != 0)
+		{
+			checked.temperature = temperature;
+			temperature_ok = check_predicate(&temperature_validator, &temperature_message, &temperature);
+		}
+
+		if ((changed & DATA_FIELD_HUMIDITY) != 0)
+		{
+			checked.humidity = humidity;
+			humidity_ok = check_predicate(&humidity_validator, &humidity_message, &humidity);
+		}
+
+		bool violated = !temperature_ok || !humidity_ok;
+
+		// Add the reading to the batch to be sent
+		collect_msg_t msg;
+		memset(&msg, 0, sizeof(collect_msg_t));
+
+		msg.temperature = temperature;
+		msg.humidity = humidity;
+		msg.pred_violated = violated;
+	
+		batch_add(&collect_batch, &msg);
 	}
  
 exit:
 	printf("Exiting data collector process...\n");
+	sensor_sampler_stop();
+	batch_flush(&collect_batch);
 	mesh_close(&mc);
 	PROCESS_END();
 }
@@ -311,31 +488,40 @@ exit:
 
 PROCESS_THREAD(predicate_checker_process, ev, data)
 {
-	static struct etimer et;
- 
 	PROCESS_EXITHANDLER(goto exit;)
 	PROCESS_BEGIN();
 
-	multi_hop_check_start();
+	multi_hop_check_start(BEACON_PERIOD);
+
+	predicate_service_start(PROGRAM_PERIOD, &predicate_program_message);
+
+	// While neighbours beacon their data the predicates are only
+	// checked when the data they read changes. Otherwise both are
+	// checked from the same neighbour data when they are due together.
+	neighbour_predicate_register(
+		&neighbour_humidity_validator,
+		&neighbour_humidity_message,
+		BEACON_PERIOD != 0 ? 0 : 80, DATA_FIELD_HUMIDITY);
 
-	// Generate data every 60 seconds
-	etimer_set(&et, 80 * CLOCK_SECOND);
+	neighbour_predicate_register(
+		&neighbour_temperature_validator,
+		&neighbour_temperature_message,
+		BEACON_PERIOD != 0 ? 0 : 120, DATA_FIELD_TEMPERATURE);
  
 	while (true)
 	{
-		PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
+		PROCESS_WAIT_EVENT_UNTIL(ev == serial_line_event_message);
 
-		printf("Checking 1-hop predicates...\n");
-
-		check_1_hop_information(
-			&neighbour_humidity_validator,
-			&neighbour_humidity_message);
-
-		etimer_reset(&et);
+		// Only the sink accepts new programs
+		if (rimeaddr_cmp(&rimeaddr_node_addr, &destination))
+		{
+			serial_line_command((char const *)data);
+		}
 	}
  
 exit:
 	printf("Exiting predicate checker process...\n");
+	predicate_service_stop();
 	multi_hop_check_end();
 	PROCESS_END();
 }
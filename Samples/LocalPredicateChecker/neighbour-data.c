@@ -0,0 +1,98 @@
+#include "neighbour-data.h"
+
+#include <string.h>
+
+#include "contiki.h"
+
+void neighbour_data_init(neighbour_data_t * table, unsigned long ttl)
+{
+	memset(table, 0, sizeof(neighbour_data_t));
+	table->ttl = ttl;
+}
+
+/** Returns the index of the neighbour's entry, or count if there is none */
+static uint8_t find_index(neighbour_data_t const * table, rimeaddr_t const * addr)
+{
+	uint8_t i;
+	for (i = 0; i != table->count; ++i)
+	{
+		if (rimeaddr_cmp(&table->entries[i].addr, addr))
+		{
+			break;
+		}
+	}
+
+	return i;
+}
+
+uint8_t neighbour_data_update(neighbour_data_t * table, rimeaddr_t const * addr, data_t const * data)
+{
+	uint8_t changed = DATA_FIELD_TEMPERATURE | DATA_FIELD_HUMIDITY;
+	uint8_t index = find_index(table, addr);
+	neighbour_data_entry_t * entry = &table->entries[index];
+
+	if (index == table->count)
+	{
+		if (table->count != NEIGHBOUR_DATA_MAX)
+		{
+			table->count++;
+		}
+		else
+		{
+			// Replace the oldest data
+			entry = &table->entries[0];
+
+			uint8_t i;
+			for (i = 1; i != table->count; ++i)
+			{
+				if (table->entries[i].received < entry->received)
+				{
+					entry = &table->entries[i];
+				}
+			}
+		}
+
+		rimeaddr_copy(&entry->addr, addr);
+	}
+	else
+	{
+		changed = data_changed_fields(&entry->data, data);
+	}
+
+	// Changes within the resolution are not stored, so that
+	// slow drift is still noticed once it adds up. Only the fields
+	// that changed are stored, the others keep their baseline.
+	data_copy_fields(&entry->data, data, changed);
+
+	entry->received = clock_seconds();
+
+	return changed;
+}
+
+neighbour_data_entry_t const * neighbour_data_find(neighbour_data_t const * table, rimeaddr_t const * addr)
+{
+	uint8_t index = find_index(table, addr);
+
+	return index == table->count ? NULL : &table->entries[index];
+}
+
+bool neighbour_data_is_fresh(neighbour_data_t const * table, neighbour_data_entry_t const * entry)
+{
+	return entry != NULL && clock_seconds() - entry->received < table->ttl;
+}
+
+uint8_t neighbour_data_fresh(neighbour_data_t const * table, rimeaddr_t * addrs, uint8_t max)
+{
+	uint8_t count = 0;
+
+	uint8_t i;
+	for (i = 0; i != table->count && count != max; ++i)
+	{
+		if (neighbour_data_is_fresh(table, &table->entries[i]))
+		{
+			rimeaddr_copy(&addrs[count++], &table->entries[i].addr);
+		}
+	}
+
+	return count;
+}
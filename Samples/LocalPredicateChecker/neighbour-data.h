@@ -0,0 +1,57 @@
+#ifndef CS407_NEIGHBOUR_DATA_H
+#define CS407_NEIGHBOUR_DATA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "net/rime.h"
+
+#include "predicate-checker.h"
+
+// The most neighbours whose data can be remembered at once
+#define NEIGHBOUR_DATA_MAX 8
+
+typedef struct
+{
+	rimeaddr_t addr;
+	data_t data;
+
+	// When the data was received, in seconds
+	unsigned long received;
+
+} neighbour_data_entry_t;
+
+typedef struct
+{
+	neighbour_data_entry_t entries[NEIGHBOUR_DATA_MAX];
+	uint8_t count;
+
+	// How long, in seconds, data is used for before it
+	// has to be requested again
+	unsigned long ttl;
+
+} neighbour_data_t;
+
+/** Set up an empty table of neighbour data */
+void neighbour_data_init(neighbour_data_t * table, unsigned long ttl);
+
+/** Record data received from a neighbour. When the table is full
+	the entry that was received longest ago is replaced. Returns the
+	DATA_FIELD_ flags of the fields that changed, all of them if the
+	neighbour was not in the table. */
+uint8_t neighbour_data_update(neighbour_data_t * table, rimeaddr_t const * addr, data_t const * data);
+
+/** Returns the data from a neighbour, or NULL if there is none */
+neighbour_data_entry_t const * neighbour_data_find(neighbour_data_t const * table, rimeaddr_t const * addr);
+
+/** Is the entry young enough to be used without asking for it again */
+bool neighbour_data_is_fresh(neighbour_data_t const * table, neighbour_data_entry_t const * entry);
+
+/** Copies up to max addresses of neighbours with fresh data into addrs
+	and returns how many there were */
+uint8_t neighbour_data_fresh(neighbour_data_t const * table, rimeaddr_t * addrs, uint8_t max);
+
+/** The table the 1-hop checker fills from our neighbours' replies and beacons */
+neighbour_data_t const * multi_hop_neighbour_data(void);
+
+#endif /*CS407_NEIGHBOUR_DATA_H*/
@@ -3,17 +3,23 @@
 #include "contiki.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "lib/sensors.h"
 #include "dev/sht11.h"
 #include "dev/sht11-sensor.h"
 
+#include "lib/random.h"
+
 #include "net/rime/runicast.h"
 #include "net/rime/ipolite.h"
+#include "net/rime/broadcast.h"
 #include "contiki-net.h"
 
 #include "../Common/sensor-converter-broken.h"
 #include "../Common/debug-helper.h"
+#include "../Common/sensor-sampler.h"
+#include "neighbour-data.h"
 
 
 bool check_predicate(
@@ -31,13 +37,49 @@ bool check_predicate(
 	return result;
 }
 
+// Changes smaller than these are treated as sensor noise,
+// they are 0.5C and 1% relative humidity
+static const int16_t TEMPERATURE_RESOLUTION = 50;
+static const int16_t HUMIDITY_RESOLUTION = 100;
+
+uint8_t data_changed_fields(data_t const * from, data_t const * to)
+{
+	uint8_t changed = 0;
+
+	if (abs(from->temperature - to->temperature) > TEMPERATURE_RESOLUTION)
+	{
+		changed |= DATA_FIELD_TEMPERATURE;
+	}
+
+	if (abs(from->humidity - to->humidity) > HUMIDITY_RESOLUTION)
+	{
+		changed |= DATA_FIELD_HUMIDITY;
+	}
+
+	return changed;
+}
+
+void data_copy_fields(data_t * to, data_t const * from, uint8_t fields)
+{
+	if ((fields & DATA_FIELD_TEMPERATURE) != 0)
+	{
+		to->temperature = from->temperature;
+	}
+
+	if ((fields & DATA_FIELD_HUMIDITY) != 0)
+	{
+		to->humidity = from->humidity;
+	}
+}
+
 
 
 
 typedef enum
 {
 	local_data_req_type,
-	local_data_resp_type
+	local_data_resp_type,
+	local_data_beacon_type
 } message_type_t;
 
 static const char * message_type_to_string(message_type_t type)
@@ -46,6 +88,7 @@ static const char * message_type_to_string(message_type_t type)
 	{
 		case local_data_req_type: return "REQ Message";
 		case local_data_resp_type: return "RESP Message";
+		case local_data_beacon_type: return "BEACON Message";
 		default: return "Unknown Message";
 	}
 }
@@ -57,10 +100,18 @@ typedef struct
 	uint8_t type;
 } base_msg_t;
 
+/** A request is followed by fresh_count addresses of neighbours
+	whose data the requester already has, they do not need to reply. */
 typedef struct
 {
 	base_msg_t base;
 
+	// Out of 255, the chance that each neighbour asked replies.
+	// This lets the requester cap how many replies it gets.
+	uint8_t reply_chance;
+
+	uint8_t fresh_count;
+
 } local_data_req_msg_t;
 
 typedef struct
@@ -71,17 +122,273 @@ typedef struct
 
 } local_data_resp_msg_t;
 
+typedef struct
+{
+	base_msg_t base;
+
+	data_t data;
 
-static const int RETRANSMISSIONS = 25;
+} local_data_beacon_msg_t;
+
+
+static const int RETRANSMISSIONS = 4;
 static const int MAXDUPS = 6;
 static const clock_time_t POLITE_INTERVAL = 5 * CLOCK_SECOND;
 
+// Replies are spread randomly over this window after a request is
+// heard, so the neighbours do not all transmit at once
+static const clock_time_t RESPONSE_WINDOW = 20 * CLOCK_SECOND;
+
+// How long to wait before trying a reply again when another is being sent
+static const clock_time_t REPLY_RETRY = CLOCK_SECOND / 2;
+
+// The time after the response window for the last replies to arrive
+static const clock_time_t RESPONSE_MARGIN = 10 * CLOCK_SECOND;
+
+// The most replies a requester wants to a single request
+static const uint8_t MAX_REPLIES = 6;
+
+// The neighbourhood size assumed before any of our requests are
+// answered, so the first request is capped as well
+static const uint16_t DEFAULT_NEIGHBOURHOOD = 12;
+
+// The most requesters that can be waiting for a reply from us
+#define MAX_PENDING_REPLIES 4
+
+// Predicates due within this many seconds of a round are checked in it,
+// so predicates with similar periods share requests
+static const unsigned long ROUND_SLACK = 10;
+
+// The longest, in seconds, the checker sleeps before looking for due
+// predicates, this keeps the wait within what an etimer can count.
+static const unsigned long MAX_ROUND_WAIT = 60;
+
+// How old, in seconds, a cached reading sent to a neighbour can be
+static const unsigned long DATA_MAX_AGE = 20;
+
+// How long, in seconds, a neighbour's data is used for before it is
+// asked for again. This spans a few checks so most are answered
+// from the cache rather than the network.
+static const unsigned long NEIGHBOUR_DATA_TTL = 240;
+
 
 static struct ipolite_conn pc;
 static struct runicast_conn rc;
+static struct broadcast_conn bc;
+
+// How often our data is pushed to our neighbours, 0 if it is not
+static clock_time_t beacon_period;
+static struct ctimer beacon_ct;
+
+typedef struct
+{
+	neighbour_predicate_checker_t predicate;
+	neighbour_predicate_failure_message_t message;
+
+	// How often, in seconds, the predicate is checked
+	unsigned long period;
+	unsigned long next_check;
+
+	uint8_t fields;
+
+	bool is_active;
+
+} neighbour_predicate_t;
+
+static neighbour_predicate_t neighbour_predicates[MAX_NEIGHBOUR_PREDICATES];
+
+// A bit for each predicate being checked in the current round
+static uint8_t round_predicates;
+
+static neighbour_data_t neighbour_data;
+
+// Nodes heard from in this and the previous round, as bitmaps of hashed
+// addresses so the count is not limited by the neighbour table's size
+#define HEARD_BITS 256
+static uint8_t heard[2][HEARD_BITS / 8];
+static uint8_t heard_current;
+
+// The replies to our last request and the chance they were sent with,
+// reply_chance is 0 until a request has been answered
+static uint8_t round_replies;
+static uint8_t last_reply_chance;
+static uint8_t last_replies;
+static uint8_t last_fresh_count;
+
+/** Record a node we have overheard any traffic from */
+static void mark_heard(rimeaddr_t const * addr)
+{
+	uint8_t hash = 0;
+	unsigned int i;
+	for (i = 0; i != sizeof(rimeaddr_t); ++i)
+	{
+		hash = hash * 31 + addr->u8[i];
+	}
+
+	heard[heard_current][hash / 8] |= 1 << (hash % 8);
+}
+
+/** Start a new period of overhearing, forgetting the oldest one */
+static void rotate_heard(void)
+{
+	heard_current ^= 1;
+	memset(heard[heard_current], 0, sizeof(heard[heard_current]));
+}
+
+/** Estimate how many neighbours we have. This is the most of the nodes
+	overheard recently, the replies to our last request scaled up by the
+	chance they were sent with, and the entries in the neighbour table. */
+static uint16_t neighbourhood_estimate(void)
+{
+	uint16_t estimate = 0;
+
+	unsigned int i;
+	for (i = 0; i != HEARD_BITS / 8; ++i)
+	{
+		uint8_t bits = heard[0][i] | heard[1][i];
+
+		while (bits != 0)
+		{
+			bits &= bits - 1;
+			++estimate;
+		}
+	}
+
+	if (last_reply_chance == 0)
+	{
+		// Until one of our requests is answered
+		// only the nodes that talk to others are heard
+		if (estimate < DEFAULT_NEIGHBOURHOOD)
+		{
+			estimate = DEFAULT_NEIGHBOURHOOD;
+		}
+	}
+	else
+	{
+		uint16_t scaled = last_fresh_count +
+			((uint16_t)last_replies * UINT8_MAX) / last_reply_chance;
+
+		if (estimate < scaled)
+		{
+			estimate = scaled;
+		}
+	}
+
+	if (estimate < neighbour_data.count)
+	{
+		estimate = neighbour_data.count;
+	}
 
-static neighbour_predicate_checker_t current_pred_check;
-static neighbour_predicate_failure_message_t current_pred_msg;
+	return estimate;
+}
+
+/** Check a neighbour's data against the predicates that
+	are only checked when a field they read changes */
+static void evaluate_changed(uint8_t changed, data_t const * data, rimeaddr_t const * from)
+{
+	uint8_t i;
+	for (i = 0; i != MAX_NEIGHBOUR_PREDICATES; ++i)
+	{
+		neighbour_predicate_t const * pred = &neighbour_predicates[i];
+
+		if (pred->is_active && pred->period == 0 && (pred->fields & changed) != 0 &&
+			!(*pred->predicate)(data, from))
+		{
+			(*pred->message)(data, from);
+		}
+	}
+}
+
+typedef struct
+{
+	rimeaddr_t requester;
+	bool is_pending;
+	struct ctimer ct;
+
+} pending_reply_t;
+
+static pending_reply_t pending_replies[MAX_PENDING_REPLIES];
+
+/** Is our address one of those the requester already has fresh data for */
+static bool is_fresh_at_requester(local_data_req_msg_t const * msg)
+{
+	rimeaddr_t const * fresh = (rimeaddr_t const *)(msg + 1);
+
+	uint8_t i;
+	for (i = 0; i != msg->fresh_count; ++i)
+	{
+		if (rimeaddr_cmp(&fresh[i], &rimeaddr_node_addr))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void send_reply(void * ptr)
+{
+	pending_reply_t * reply = (pending_reply_t *)ptr;
+
+	// Only one reply can be sent at a time
+	if (runicast_is_transmitting(&rc))
+	{
+		ctimer_set(&reply->ct, REPLY_RETRY + random_rand() % REPLY_RETRY, &send_reply, reply);
+		return;
+	}
+
+	sensor_reading_t const * reading = sensor_sampler_get(DATA_MAX_AGE);
+
+	// Send data message
+	packetbuf_clear();
+	packetbuf_set_datalen(sizeof(local_data_resp_msg_t));
+	debug_packet_size(sizeof(local_data_resp_msg_t));
+	local_data_resp_msg_t * msg = (local_data_resp_msg_t *)packetbuf_dataptr();
+	memset(msg, 0, sizeof(local_data_resp_msg_t));
+
+	msg->base.type = local_data_resp_type;
+	msg->data.temperature = reading->temperature;
+	msg->data.humidity = reading->humidity;
+
+	runicast_send(&rc, &reply->requester, RETRANSMISSIONS);
+
+	reply->is_pending = false;
+}
+
+/** Schedules a reply to the requester at a random time in the response
+	window. A requester that is already waiting for a reply gets only
+	that one, with the data as it is when it is sent. */
+static void schedule_reply(rimeaddr_t const * requester)
+{
+	pending_reply_t * free_reply = NULL;
+
+	uint8_t i;
+	for (i = 0; i != MAX_PENDING_REPLIES; ++i)
+	{
+		pending_reply_t * reply = &pending_replies[i];
+
+		if (!reply->is_pending)
+		{
+			free_reply = reply;
+		}
+		else if (rimeaddr_cmp(&reply->requester, requester))
+		{
+			printf("Already replying to %s\n", addr2str(requester));
+			return;
+		}
+	}
+
+	if (free_reply == NULL)
+	{
+		printf("Too many replies pending, not replying to %s\n", addr2str(requester));
+		return;
+	}
+
+	rimeaddr_copy(&free_reply->requester, requester);
+	free_reply->is_pending = true;
+
+	ctimer_set(&free_reply->ct, random_rand() % RESPONSE_WINDOW, &send_reply, free_reply);
+}
 
 static void pc_recv(struct ipolite_conn * ptr, rimeaddr_t const * sender)
 {
@@ -91,30 +398,31 @@ static void pc_recv(struct ipolite_conn * ptr, rimeaddr_t const * sender)
 	{
 		case local_data_req_type:
 		{
-			printf("Got req, sending data\n");
-
-			// Read raw sensor data
-			SENSORS_ACTIVATE(sht11_sensor);
-			unsigned raw_temperature = sht11_sensor.value(SHT11_SENSOR_TEMP);
-			unsigned raw_humidity = sht11_sensor.value(SHT11_SENSOR_HUMIDITY);
-			SENSORS_DEACTIVATE(sht11_sensor);
-
-			// Convert to human understandable values
-			double temperature = sht11_temperature(raw_temperature);
-			double humidity = sht11_relative_humidity_compensated(raw_humidity, temperature);
-
-			// Send data message
-			packetbuf_clear();
-			packetbuf_set_datalen(sizeof(local_data_resp_msg_t));
-			debug_packet_size(sizeof(local_data_resp_msg_t));
-			local_data_resp_msg_t * msg = (local_data_resp_msg_t *)packetbuf_dataptr();
-			memset(msg, 0, sizeof(local_data_resp_msg_t));
-
-			msg->base.type = local_data_resp_type;
-			msg->data.temperature = temperature;
-			msg->data.humidity = humidity;
-	
-			runicast_send(&rc, sender, RETRANSMISSIONS);
+			local_data_req_msg_t const * req = (local_data_req_msg_t const *)bmsg;
+
+			mark_heard(sender);
+
+			if (packetbuf_datalen() < sizeof(local_data_req_msg_t) + req->fresh_count * sizeof(rimeaddr_t))
+			{
+				printf("Req too short Addr:%s\n", addr2str(sender));
+				break;
+			}
+
+			if (is_fresh_at_requester(req))
+			{
+				printf("Req has fresh data for us, not replying\n");
+				break;
+			}
+
+			if (req->reply_chance != UINT8_MAX && random_rand() % UINT8_MAX >= req->reply_chance)
+			{
+				printf("Req does not need our data, not replying\n");
+				break;
+			}
+
+			printf("Got req, scheduling reply\n");
+
+			schedule_reply(sender);
 		} break;
 
 		default:
@@ -129,7 +437,123 @@ static void pc_recv(struct ipolite_conn * ptr, rimeaddr_t const * sender)
 static const struct ipolite_callbacks pc_callbacks = { &pc_recv, NULL, NULL };
 
 
+static void beacon_recv(struct broadcast_conn * c, rimeaddr_t const * sender)
+{
+	local_data_beacon_msg_t const * msg = (local_data_beacon_msg_t const *)packetbuf_dataptr();
+
+	if (packetbuf_datalen() < sizeof(local_data_beacon_msg_t) ||
+		msg->base.type != local_data_beacon_type)
+	{
+		printf("Unknown beacon Addr:%s Type:%d (%s)\n",
+			addr2str(sender),
+			msg->base.type, message_type_to_string(msg->base.type));
+		return;
+	}
+
+	mark_heard(sender);
+
+	uint8_t changed = neighbour_data_update(&neighbour_data, sender, &msg->data);
+
+	evaluate_changed(changed, &msg->data, sender);
+}
+
+static const struct broadcast_callbacks bc_callbacks = { &beacon_recv, NULL };
+
+static void send_beacon(void * ptr);
 
+static void set_beacon_timer(void)
+{
+	// Wait between half and one and a half periods, so that
+	// nodes which started together do not keep colliding
+	clock_time_t wait = beacon_period / 2 + random_rand() % beacon_period;
+
+	ctimer_set(&beacon_ct, wait, &send_beacon, NULL);
+}
+
+static void send_beacon(void * ptr)
+{
+	sensor_reading_t const * reading = sensor_sampler_get(DATA_MAX_AGE);
+
+	packetbuf_clear();
+	packetbuf_set_datalen(sizeof(local_data_beacon_msg_t));
+	debug_packet_size(sizeof(local_data_beacon_msg_t));
+	local_data_beacon_msg_t * msg = (local_data_beacon_msg_t *)packetbuf_dataptr();
+	memset(msg, 0, sizeof(local_data_beacon_msg_t));
+
+	msg->base.type = local_data_beacon_type;
+	msg->data.temperature = reading->temperature;
+	msg->data.humidity = reading->humidity;
+
+	broadcast_send(&bc);
+
+	set_beacon_timer();
+}
+
+
+
+
+/** Seconds until the next predicate is due, 0 if none are registered */
+static unsigned long seconds_until_due(void)
+{
+	unsigned long const now = clock_seconds();
+	unsigned long wait = 0;
+
+	uint8_t i;
+	for (i = 0; i != MAX_NEIGHBOUR_PREDICATES; ++i)
+	{
+		neighbour_predicate_t const * pred = &neighbour_predicates[i];
+
+		if (pred->is_active && pred->period != 0)
+		{
+			// Already due predicates still need a tick to be started
+			unsigned long until = pred->next_check > now ? pred->next_check - now : 1;
+
+			if (wait == 0 || until < wait)
+			{
+				wait = until;
+			}
+		}
+	}
+
+	return wait;
+}
+
+/** Returns the predicates that are due now and schedules their next check */
+static uint8_t start_round(void)
+{
+	unsigned long const now = clock_seconds();
+	uint8_t due = 0;
+
+	uint8_t i;
+	for (i = 0; i != MAX_NEIGHBOUR_PREDICATES; ++i)
+	{
+		neighbour_predicate_t * pred = &neighbour_predicates[i];
+
+		if (pred->is_active && pred->period != 0 && pred->next_check <= now + ROUND_SLACK)
+		{
+			due |= 1 << i;
+			pred->next_check = now + pred->period;
+		}
+	}
+
+	return due;
+}
+
+/** Check a neighbour's data against every predicate in the current round */
+static void evaluate_round(data_t const * data, rimeaddr_t const * from)
+{
+	uint8_t i;
+	for (i = 0; i != MAX_NEIGHBOUR_PREDICATES; ++i)
+	{
+		neighbour_predicate_t const * pred = &neighbour_predicates[i];
+
+		if ((round_predicates & (1 << i)) != 0 && pred->is_active &&
+			!(*pred->predicate)(data, from))
+		{
+			(*pred->message)(data, from);
+		}
+	}
+}
 
 /** The function that will be executed when a message is received */
 static void recv(struct runicast_conn * c, rimeaddr_t const * from, uint8_t hops)
@@ -142,15 +566,22 @@ static void recv(struct runicast_conn * c, rimeaddr_t const * from, uint8_t hops
 		{
 			local_data_resp_msg_t * msg = (local_data_resp_msg_t *)bmsg;
 
-			printf("Got response (T:%d H:%d%%), checking predicate against it\n",
-				(int)msg->data.temperature, (int)msg->data.humidity);
+			printf("Got response (T:%d H:%d%%), checking predicates against it\n",
+				msg->data.temperature / 100, msg->data.humidity / 100);
+
+			mark_heard(from);
 
-			// Evaulate received data in the predicate
-			if (!(*current_pred_check)(&msg->data, from))
+			if (round_replies != UINT8_MAX)
 			{
-				(*current_pred_msg)(&msg->data, from);
+				++round_replies;
 			}
 
+			uint8_t changed = neighbour_data_update(&neighbour_data, from, &msg->data);
+
+			// Evaulate received data in the round's predicates
+			evaluate_round(&msg->data, from);
+			evaluate_changed(changed, &msg->data, from);
+
 		} break;
 
 		default:
@@ -183,33 +614,48 @@ static const struct runicast_callbacks rc_callbacks = { &recv, &sent, &timeout }
 
 PROCESS(one_hop_predicate_checker_process, "1-Hop Predicate Checker");
 
-bool check_1_hop_information(
+bool neighbour_predicate_register(
 	neighbour_predicate_checker_t predicate,
-	neighbour_predicate_failure_message_t message
-	)
+	neighbour_predicate_failure_message_t message,
+	unsigned long period, uint8_t fields)
 {
-	if (process_is_running(&one_hop_predicate_checker_process))
+	uint8_t i;
+	for (i = 0; i != MAX_NEIGHBOUR_PREDICATES; ++i)
 	{
-		printf("1-hop check process is already running, not starting new process\n");
+		neighbour_predicate_t * pred = &neighbour_predicates[i];
 
-		return false;
+		if (!pred->is_active)
+		{
+			pred->predicate = predicate;
+			pred->message = message;
+			pred->period = period;
+			pred->next_check = clock_seconds() + period;
+			pred->fields = fields;
+			pred->is_active = true;
+
+			// Have the checker work out when it next needs to wake up
+			process_poll(&one_hop_predicate_checker_process);
+
+			return true;
+		}
 	}
-	else
-	{
-		// Set the predicate and the message that should
-		// be called to check a predicate and then send information
-		// about it should the predicate fail.
-		//
-		// As we do it this way, then it is not possible to have
-		// multiple 1-hop checks running at once.
-		current_pred_check = predicate;
-		current_pred_msg = message;
 
-		printf("Starting 1-hop predicate checker process...\n");
+	printf("No space to register another 1-hop predicate\n");
 
-		process_start(&one_hop_predicate_checker_process, NULL);
+	return false;
+}
 
-		return true;
+void neighbour_predicate_unregister(neighbour_predicate_checker_t predicate)
+{
+	uint8_t i;
+	for (i = 0; i != MAX_NEIGHBOUR_PREDICATES; ++i)
+	{
+		neighbour_predicate_t * pred = &neighbour_predicates[i];
+
+		if (pred->is_active && pred->predicate == predicate)
+		{
+			pred->is_active = false;
+		}
 	}
 }
 
@@ -217,55 +663,232 @@ bool check_1_hop_information(
 PROCESS_THREAD(one_hop_predicate_checker_process, ev, data)
 {
 	static struct etimer et;
+	static rimeaddr_t fresh[NEIGHBOUR_DATA_MAX];
+	static uint8_t fresh_count;
+	static uint8_t length;
  
 	PROCESS_EXITHANDLER(goto exit;)
 	PROCESS_BEGIN();
 
-	runicast_open(&rc, 118, &rc_callbacks);
+	while (true)
+	{
+		// Sleep until the next predicate is due, or one is registered
+		{
+			unsigned long wait = seconds_until_due();
 
-	printf("Sending req bcast\n");
+			if (wait == 0)
+			{
+				PROCESS_WAIT_EVENT_UNTIL(ev == PROCESS_EVENT_POLL);
+				continue;
+			}
 
-	// Send req message
-	packetbuf_clear();
-	packetbuf_set_datalen(sizeof(local_data_req_msg_t));
-	debug_packet_size(sizeof(local_data_req_msg_t));
-	local_data_req_msg_t * msg = (local_data_req_msg_t *)packetbuf_dataptr();
-	memset(msg, 0, sizeof(local_data_req_msg_t));
+			etimer_set(&et, (wait < MAX_ROUND_WAIT ? wait : MAX_ROUND_WAIT) * CLOCK_SECOND);
+			PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et) || ev == PROCESS_EVENT_POLL);
+		}
+
+		round_predicates = start_round();
+
+		if (round_predicates == 0)
+		{
+			continue;
+		}
+
+		printf("Checking 1-hop predicates...\n");
+
+		// Evaluate the predicates against the data we already have
+		{
+			uint8_t i;
+			for (i = 0; i != neighbour_data.count; ++i)
+			{
+				neighbour_data_entry_t const * entry = &neighbour_data.entries[i];
+
+				if (neighbour_data_is_fresh(&neighbour_data, entry))
+				{
+					evaluate_round(&entry->data, &entry->addr);
+				}
+			}
+		}
+
+		fresh_count = neighbour_data_fresh(&neighbour_data, fresh, NEIGHBOUR_DATA_MAX);
+
+		// Neighbours push their data when beaconing, so never ask for it
+		if (beacon_period != 0)
+		{
+			printf("Checked %u neighbours from beacons\n", fresh_count);
+			round_predicates = 0;
+			continue;
+		}
+
+		// When all the data we know of is fresh there is nothing to ask for.
+		// New neighbours are found the next time an entry goes stale.
+		if (fresh_count != 0 && fresh_count == neighbour_data.count)
+		{
+			printf("All %u neighbours have fresh data, not sending req\n", fresh_count);
+			round_predicates = 0;
+			continue;
+		}
+
+		printf("Sending req bcast, %u neighbours have fresh data\n", fresh_count);
+
+		// Send req message, followed by the neighbours that need not reply
+		length = sizeof(local_data_req_msg_t) + fresh_count * sizeof(rimeaddr_t);
+
+		packetbuf_clear();
+		packetbuf_set_datalen(length);
+		debug_packet_size(length);
+		local_data_req_msg_t * msg = (local_data_req_msg_t *)packetbuf_dataptr();
+		memset(msg, 0, length);
 
-	msg->base.type = local_data_req_type;
+		msg->base.type = local_data_req_type;
+		msg->fresh_count = fresh_count;
 
-	ipolite_send(&pc, POLITE_INTERVAL, sizeof(local_data_req_msg_t));
+		// The neighbours with stale data are asked, capped at MAX_REPLIES.
+		// How many there are is estimated from the traffic we overhear,
+		// as the neighbour table only holds a few of them.
+		{
+			uint16_t estimate = neighbourhood_estimate();
+			uint16_t stale_count = estimate > fresh_count ? estimate - fresh_count : 0;
+
+			msg->reply_chance = stale_count <= MAX_REPLIES
+				? UINT8_MAX
+				: (uint8_t)(((uint16_t)UINT8_MAX * MAX_REPLIES) / stale_count);
+
+			printf("Estimated %u neighbours, reply chance %u/255\n",
+				estimate, msg->reply_chance);
+		}
+
+		memcpy(msg + 1, fresh, fresh_count * sizeof(rimeaddr_t));
+
+		last_reply_chance = msg->reply_chance;
+		last_fresh_count = fresh_count;
+		round_replies = 0;
+		rotate_heard();
 
-	printf("Waiting for responses...\n");
+		ipolite_send(&pc, POLITE_INTERVAL, length);
 
-	// Wait for 60 seconds
-	etimer_set(&et, 60 * CLOCK_SECOND);
-	PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
+		printf("Waiting for responses...\n");
 
-	// We have either received all we are going to
-	// and have evaluated the predicate against
-	// those responses, so cancel sending.
-	ipolite_cancel(&pc);
+		// Wait for the request to be sent and the replies to it,
+		// each reply is evaluated against the round's predicates
+		// as it arrives.
+		etimer_set(&et, POLITE_INTERVAL + RESPONSE_WINDOW + RESPONSE_MARGIN);
+		PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
 
+		// We have either received all we are going to
+		// and have evaluated the predicates against
+		// those responses, so cancel sending.
+		ipolite_cancel(&pc);
+
+		last_replies = round_replies;
+
+		round_predicates = 0;
+	}
  
 exit:
 	printf("Exiting predicate checker process...\n");
-	runicast_close(&rc);
+	round_predicates = 0;
+	PROCESS_END();
+}
+
+
+PROCESS(own_data_change_process, "Own Data Change Checker");
+
+/** Checks the predicates that read our own fields against every
+	neighbour when a new reading changes those fields */
+PROCESS_THREAD(own_data_change_process, ev, data)
+{
+	static data_t last_own;
+	static bool has_last_own;
+
+	PROCESS_BEGIN();
+
+	has_last_own = false;
+
+	while (true)
+	{
+		PROCESS_WAIT_EVENT_UNTIL(ev == sensor_sampler_event);
+
+		sensor_reading_t const * reading = (sensor_reading_t const *)data;
+
+		data_t own;
+		own.temperature = reading->temperature;
+		own.humidity = reading->humidity;
+
+		uint8_t changed = has_last_own
+			? data_changed_fields(&last_own, &own)
+			: DATA_FIELD_TEMPERATURE | DATA_FIELD_HUMIDITY;
+
+		if (changed == 0)
+		{
+			continue;
+		}
+
+		data_copy_fields(&last_own, &own, changed);
+		has_last_own = true;
+
+		uint8_t i;
+		for (i = 0; i != neighbour_data.count; ++i)
+		{
+			neighbour_data_entry_t const * entry = &neighbour_data.entries[i];
+
+			if (neighbour_data_is_fresh(&neighbour_data, entry))
+			{
+				evaluate_changed(changed, &entry->data, &entry->addr);
+			}
+		}
+	}
+
 	PROCESS_END();
 }
 
+neighbour_data_t const * multi_hop_neighbour_data(void)
+{
+	return &neighbour_data;
+}
 
-void multi_hop_check_start(void)
+void multi_hop_check_start(clock_time_t period)
 {
+	neighbour_data_init(&neighbour_data, NEIGHBOUR_DATA_TTL);
+
+	beacon_period = period;
+
+	if (beacon_period != 0)
+	{
+		broadcast_open(&bc, 137, &bc_callbacks);
+		set_beacon_timer();
+	}
+
 	// Open the connection that listens for data
-	// requests
+	// requests, and the one replies are sent on
 	ipolite_open(&pc, 132, MAXDUPS, &pc_callbacks);
+	runicast_open(&rc, 118, &rc_callbacks);
+
+	process_start(&one_hop_predicate_checker_process, NULL);
+	process_start(&own_data_change_process, NULL);
 }
 
 void multi_hop_check_end(void)
 {
+	process_exit(&one_hop_predicate_checker_process);
+	process_exit(&own_data_change_process);
+
 	// Stop listening for data requests
 	ipolite_close(&pc);
+
+	uint8_t i;
+	for (i = 0; i != MAX_PENDING_REPLIES; ++i)
+	{
+		ctimer_stop(&pending_replies[i].ct);
+		pending_replies[i].is_pending = false;
+	}
+
+	runicast_close(&rc);
+
+	if (beacon_period != 0)
+	{
+		ctimer_stop(&beacon_ct);
+		broadcast_close(&bc);
+	}
 }
 
 
@@ -2,6 +2,7 @@
 #define PREDICATE_CHECKER_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "net/netstack.h"
 #include "net/rime.h"
@@ -16,23 +17,51 @@ bool check_predicate(
 	void const * state);
 
 
+/** A node's readings, in hundredths of a degree Celcius
+ *  and of a percent relative humidity */
 typedef struct
 {
-	double temperature;
-	double humidity;
+	int16_t temperature;
+	int16_t humidity;
 } data_t;
 
 typedef bool (*neighbour_predicate_checker_t)(data_t const *, rimeaddr_t const *);
 typedef void (*neighbour_predicate_failure_message_t)(data_t const *, rimeaddr_t const *);
 
-/** Start a process that begins checking a predicate
- *  with respect to the one hop neighbourhood. */
-bool check_1_hop_information(
+// The fields of data_t a predicate reads
+#define DATA_FIELD_TEMPERATURE (1 << 0)
+#define DATA_FIELD_HUMIDITY (1 << 1)
+
+/** The DATA_FIELD_ flags of the fields that differ by more than
+ *  their resolution, smaller changes are treated as noise. */
+uint8_t data_changed_fields(data_t const * from, data_t const * to);
+
+/** Copy only the fields given by the DATA_FIELD_ flags, so the
+ *  baselines of the other fields are left where they were. */
+void data_copy_fields(data_t * to, data_t const * from, uint8_t fields);
+
+// The most neighbourhood predicates that can be checked at once
+#define MAX_NEIGHBOUR_PREDICATES 4
+
+/** Check a predicate with respect to the one hop neighbourhood
+ *  about every period seconds, until it is unregistered.
+ *  fields are the DATA_FIELD_ flags for the data it reads.
+ *  Predicates that are due together share one gathering round.
+ *  A period of 0 checks the predicate only when a field it reads
+ *  changes, in our reading or in data heard from a neighbour. */
+bool neighbour_predicate_register(
 	neighbour_predicate_checker_t predicate,
-	neighbour_predicate_failure_message_t message);
+	neighbour_predicate_failure_message_t message,
+	unsigned long period, uint8_t fields);
+
+/** Stop checking a neighbourhood predicate */
+void neighbour_predicate_unregister(neighbour_predicate_checker_t predicate);
 
-// Initialise multi-hop predicate checking
-void multi_hop_check_start(void);
+// Initialise multi-hop predicate checking. With a beacon period each
+// node pushes its data to its neighbours in a jittered broadcast about
+// that often, and 1-hop checks only use the data overheard from them.
+// A beacon period of 0 has each check request the data instead.
+void multi_hop_check_start(clock_time_t beacon_period);
 
 // Shutdown multi-hop predicate checking
 void multi_hop_check_end(void);
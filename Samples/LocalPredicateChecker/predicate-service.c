@@ -0,0 +1,558 @@
+#include "predicate-service.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "lib/random.h"
+#include "lib/crc16.h"
+
+#include "net/rime.h"
+#include "net/rime/broadcast.h"
+#include "net/rime/runicast.h"
+
+#include "../Common/debug-helper.h"
+#include "../Common/sensor-sampler.h"
+#include "../../PredicateLanguage/predlang.h"
+#include "neighbour-data.h"
+#include "program-cache.h"
+
+// Programs are sent in chunks of this many bytes
+#define CHUNK_SIZE 32
+
+typedef enum
+{
+	manifest_type,
+	chunk_req_type,
+	chunk_type
+} message_type_t;
+
+typedef struct
+{
+	// This is a message_type_t, but a uint8_t is
+	// used for message size optimisation
+	uint8_t type;
+} base_msg_t;
+
+/** Advertises the program a node has */
+typedef struct
+{
+	base_msg_t base;
+
+	uint8_t version;
+	uint16_t length;
+	uint16_t crc;
+
+} manifest_msg_t;
+
+typedef struct
+{
+	base_msg_t base;
+
+	uint8_t version;
+	uint8_t index;
+
+} chunk_req_msg_t;
+
+typedef struct
+{
+	base_msg_t base;
+
+	uint8_t version;
+	uint8_t index;
+	uint8_t length;
+
+	uint8_t data[CHUNK_SIZE];
+
+} chunk_msg_t;
+
+/** The data a program can read about each node */
+typedef struct
+{
+	nint id;
+	nfloat temp;
+	nfloat humidity;
+
+} predicate_data_t;
+
+
+static const int RETRANSMISSIONS = 4;
+
+// Manifests are sent quickly after a new program arrives, so it spreads
+// fast, then less and less often while every neighbour agrees
+static const clock_time_t MANIFEST_MIN = 4 * CLOCK_SECOND;
+static const clock_time_t MANIFEST_MAX = 256 * CLOCK_SECOND;
+
+// How long to wait for a chunk before asking for it again
+static const clock_time_t CHUNK_TIMEOUT = 4 * CLOCK_SECOND;
+static const uint8_t CHUNK_MAX_RETRIES = 5;
+
+// How old, in seconds, our reading can be when the program is evaluated
+static const unsigned long DATA_MAX_AGE = 60;
+
+
+static struct broadcast_conn bc;
+static struct runicast_conn rc;
+
+static predicate_service_failure_t failure_fn;
+static clock_time_t evaluation_period;
+
+// The installed program
+static bool has_program = false;
+static uint8_t program[PREDICATE_PROGRAM_MAX];
+static uint8_t program_version;
+static uint16_t program_length;
+static uint16_t program_crc;
+
+static clock_time_t manifest_interval;
+static struct ctimer manifest_ct;
+
+// The program being received
+static bool is_fetching = false;
+static uint8_t fetch_buffer[PREDICATE_PROGRAM_MAX];
+static rimeaddr_t fetch_from;
+static uint8_t fetch_version;
+static uint16_t fetch_length;
+static uint16_t fetch_crc;
+static uint8_t fetch_index;
+static uint8_t fetch_retries;
+static struct ctimer fetch_ct;
+
+
+/** Versions wrap around, so compare them relative to each other */
+static bool is_newer_version(uint8_t version, uint8_t than)
+{
+	return (int8_t)(version - than) > 0;
+}
+
+static uint8_t chunk_count(uint16_t length)
+{
+	return (length + CHUNK_SIZE - 1) / CHUNK_SIZE;
+}
+
+static void send_manifest(void * ptr);
+
+/** Send a manifest at a random time in the second half of the interval */
+static void set_manifest_timer(void)
+{
+	clock_time_t wait = manifest_interval / 2 + random_rand() % (manifest_interval / 2);
+
+	ctimer_set(&manifest_ct, wait, &send_manifest, NULL);
+}
+
+static void reset_manifest_timer(void)
+{
+	manifest_interval = MANIFEST_MIN;
+	set_manifest_timer();
+}
+
+static void send_manifest(void * ptr)
+{
+	packetbuf_clear();
+	packetbuf_set_datalen(sizeof(manifest_msg_t));
+	debug_packet_size(sizeof(manifest_msg_t));
+	manifest_msg_t * msg = (manifest_msg_t *)packetbuf_dataptr();
+	memset(msg, 0, sizeof(manifest_msg_t));
+
+	msg->base.type = manifest_type;
+	msg->version = program_version;
+	msg->length = program_length;
+	msg->crc = program_crc;
+
+	broadcast_send(&bc);
+
+	if (manifest_interval < MANIFEST_MAX / 2)
+	{
+		manifest_interval *= 2;
+	}
+	else
+	{
+		manifest_interval = MANIFEST_MAX;
+	}
+
+	set_manifest_timer();
+}
+
+bool predicate_service_install(uint8_t const * new_program, uint16_t length, uint8_t version)
+{
+	if (length == 0 || length > PREDICATE_PROGRAM_MAX)
+	{
+		printf("Predicate program of length %u cannot be installed\n", length);
+		return false;
+	}
+
+	memcpy(program, new_program, length);
+	program_length = length;
+	program_version = version;
+	program_crc = crc16_data(program, length, 0);
+	has_program = true;
+
+	printf("Installed predicate program Version:%u Length:%u\n", version, length);
+
+	// Keep the program in flash so it survives a reboot
+	if (!program_cache_store(program, program_length, program_crc) ||
+		!program_cache_set_active(program_version, program_length, program_crc))
+	{
+		printf("Failed to keep predicate program Version:%u in flash\n", version);
+	}
+
+	// Let our neighbours know about it quickly
+	reset_manifest_timer();
+
+	return true;
+}
+
+
+static void request_chunk(void * ptr);
+
+static void stop_fetch(void)
+{
+	is_fetching = false;
+	ctimer_stop(&fetch_ct);
+}
+
+static void request_chunk(void * ptr)
+{
+	if (fetch_retries++ == CHUNK_MAX_RETRIES)
+	{
+		printf("Gave up fetching predicate program from %s\n", addr2str(&fetch_from));
+		stop_fetch();
+		return;
+	}
+
+	// Try again when the connection is free
+	if (!runicast_is_transmitting(&rc))
+	{
+		packetbuf_clear();
+		packetbuf_set_datalen(sizeof(chunk_req_msg_t));
+		debug_packet_size(sizeof(chunk_req_msg_t));
+		chunk_req_msg_t * msg = (chunk_req_msg_t *)packetbuf_dataptr();
+		memset(msg, 0, sizeof(chunk_req_msg_t));
+
+		msg->base.type = chunk_req_type;
+		msg->version = fetch_version;
+		msg->index = fetch_index;
+
+		runicast_send(&rc, &fetch_from, RETRANSMISSIONS);
+	}
+
+	ctimer_set(&fetch_ct, CHUNK_TIMEOUT, &request_chunk, NULL);
+}
+
+static void start_fetch(rimeaddr_t const * from, manifest_msg_t const * msg)
+{
+	printf("Fetching predicate program Version:%u Length:%u from %s\n",
+		msg->version, msg->length, addr2str(from));
+
+	is_fetching = true;
+	rimeaddr_copy(&fetch_from, from);
+	fetch_version = msg->version;
+	fetch_length = msg->length;
+	fetch_crc = msg->crc;
+	fetch_index = 0;
+	fetch_retries = 0;
+
+	request_chunk(NULL);
+}
+
+static void chunk_recv(chunk_msg_t const * msg)
+{
+	uint16_t offset = (uint16_t)msg->index * CHUNK_SIZE;
+
+	if (!is_fetching || msg->version != fetch_version || msg->index != fetch_index ||
+		offset >= fetch_length)
+	{
+		return;
+	}
+
+	// Every chunk is full apart from the last, which holds the rest
+	uint16_t expected = fetch_length - offset < CHUNK_SIZE ? fetch_length - offset : CHUNK_SIZE;
+
+	if (msg->length != expected)
+	{
+		printf("Chunk Index:%u has length %u not %u, ignoring\n",
+			msg->index, msg->length, expected);
+		return;
+	}
+
+	memcpy(fetch_buffer + offset, msg->data, msg->length);
+
+	fetch_index++;
+	fetch_retries = 0;
+
+	if (fetch_index != chunk_count(fetch_length))
+	{
+		ctimer_stop(&fetch_ct);
+		request_chunk(NULL);
+		return;
+	}
+
+	stop_fetch();
+
+	if (crc16_data(fetch_buffer, fetch_length, 0) != fetch_crc)
+	{
+		printf("Predicate program Version:%u failed its CRC\n", fetch_version);
+		return;
+	}
+
+	predicate_service_install(fetch_buffer, fetch_length, fetch_version);
+}
+
+static void send_chunk(rimeaddr_t const * to, chunk_req_msg_t const * req)
+{
+	uint16_t offset = (uint16_t)req->index * CHUNK_SIZE;
+
+	// Only the program we have can be sent, the requester
+	// will try again when the connection is free
+	if (!has_program || req->version != program_version ||
+		offset >= program_length || runicast_is_transmitting(&rc))
+	{
+		return;
+	}
+
+	uint8_t length = program_length - offset < CHUNK_SIZE ? program_length - offset : CHUNK_SIZE;
+
+	packetbuf_clear();
+	packetbuf_set_datalen(sizeof(chunk_msg_t));
+	debug_packet_size(sizeof(chunk_msg_t));
+	chunk_msg_t * msg = (chunk_msg_t *)packetbuf_dataptr();
+	memset(msg, 0, sizeof(chunk_msg_t));
+
+	msg->base.type = chunk_type;
+	msg->version = program_version;
+	msg->index = req->index;
+	msg->length = length;
+	memcpy(msg->data, program + offset, length);
+
+	runicast_send(&rc, to, RETRANSMISSIONS);
+}
+
+
+static void bc_recv(struct broadcast_conn * c, rimeaddr_t const * sender)
+{
+	manifest_msg_t const * msg = (manifest_msg_t const *)packetbuf_dataptr();
+
+	if (packetbuf_datalen() < sizeof(manifest_msg_t) || msg->base.type != manifest_type)
+	{
+		return;
+	}
+
+	if (!has_program || is_newer_version(msg->version, program_version))
+	{
+		if (is_fetching || msg->length > PREDICATE_PROGRAM_MAX)
+		{
+			return;
+		}
+
+		// We may have had the same program before under another
+		// version, then only the manifest needs to be sent
+		if (program_cache_load(fetch_buffer, msg->length, msg->crc))
+		{
+			printf("Predicate program Version:%u was in flash\n", msg->version);
+			predicate_service_install(fetch_buffer, msg->length, msg->version);
+		}
+		else
+		{
+			start_fetch(sender, msg);
+		}
+	}
+	else if (is_newer_version(program_version, msg->version))
+	{
+		// The neighbour has an old program, tell it about ours soon
+		reset_manifest_timer();
+	}
+}
+
+static const struct broadcast_callbacks bc_callbacks = { &bc_recv, NULL };
+
+static void rc_recv(struct runicast_conn * c, rimeaddr_t const * from, uint8_t seqno)
+{
+	base_msg_t const * bmsg = (base_msg_t const *)packetbuf_dataptr();
+
+	switch (bmsg->type)
+	{
+		case chunk_req_type:
+		{
+			if (packetbuf_datalen() >= sizeof(chunk_req_msg_t))
+			{
+				send_chunk(from, (chunk_req_msg_t const *)bmsg);
+			}
+		} break;
+
+		case chunk_type:
+		{
+			if (packetbuf_datalen() >= sizeof(chunk_msg_t))
+			{
+				chunk_recv((chunk_msg_t const *)bmsg);
+			}
+		} break;
+
+		default:
+		{
+			printf("Unknown predicate service message Addr:%s Type:%d\n",
+				addr2str(from), bmsg->type);
+		} break;
+	}
+}
+
+static const struct runicast_callbacks rc_callbacks = { &rc_recv, NULL, NULL };
+
+
+// The program reads the data through these functions, by name
+static void const * get_id_fn(void const * ptr)
+{
+	return &((predicate_data_t const *)ptr)->id;
+}
+
+static void const * get_temp_fn(void const * ptr)
+{
+	return &((predicate_data_t const *)ptr)->temp;
+}
+
+static void const * get_humidity_fn(void const * ptr)
+{
+	return &((predicate_data_t const *)ptr)->humidity;
+}
+
+static predicate_data_t * this_data;
+
+static void * this_data_fn(void)
+{
+	return this_data;
+}
+
+static void set_predicate_data(predicate_data_t * to, rimeaddr_t const * addr, data_t const * data)
+{
+	to->id = addr->u8[0];
+	// Programs are written in degrees and percent
+	to->temp = (nfloat)data->temperature / 100;
+	to->humidity = (nfloat)data->humidity / 100;
+}
+
+/** Evaluates the program against our data, in the array "this",
+	and our neighbours' fresh data, in the array "n1" */
+static void evaluate_program(void)
+{
+	// The VM's memory is reset for each evaluation
+	if (!init_pred_lang(&this_data_fn, sizeof(predicate_data_t)) ||
+		!register_function("id", &get_id_fn, TYPE_INTEGER) ||
+		!register_function("temp", &get_temp_fn, TYPE_FLOATING) ||
+		!register_function("humidity", &get_humidity_fn, TYPE_FLOATING))
+	{
+		printf("Failed to set up predicate VM: %s\n", error_message());
+		return;
+	}
+
+	this_data = (predicate_data_t *)create_user_array("this", 1);
+
+	neighbour_data_t const * neighbours = multi_hop_neighbour_data();
+
+	uint8_t fresh_count = 0;
+
+	uint8_t i;
+	for (i = 0; i != neighbours->count; ++i)
+	{
+		if (neighbour_data_is_fresh(neighbours, &neighbours->entries[i]))
+		{
+			++fresh_count;
+		}
+	}
+
+	predicate_data_t * n1 = (predicate_data_t *)create_user_array("n1", fresh_count);
+
+	if (this_data == NULL || n1 == NULL)
+	{
+		printf("Failed to set up predicate VM: %s\n", error_message());
+		return;
+	}
+
+	sensor_reading_t const * reading = sensor_sampler_get(DATA_MAX_AGE);
+	data_t own = { reading->temperature, reading->humidity };
+	set_predicate_data(this_data, &rimeaddr_node_addr, &own);
+
+	for (i = 0; i != neighbours->count; ++i)
+	{
+		neighbour_data_entry_t const * entry = &neighbours->entries[i];
+
+		if (neighbour_data_is_fresh(neighbours, entry))
+		{
+			set_predicate_data(n1++, &entry->addr, &entry->data);
+		}
+	}
+
+	nbool result = evaluate(program, program_length);
+
+	if (error_message() != NULL)
+	{
+		printf("Predicate program Version:%u failed to run: %s\n",
+			program_version, error_message());
+	}
+	else if (!result)
+	{
+		printf("Predicate program Version:%u evaluated to false\n", program_version);
+
+		(*failure_fn)(program_version);
+	}
+}
+
+
+PROCESS(predicate_service_process, "Predicate Service");
+
+PROCESS_THREAD(predicate_service_process, ev, data)
+{
+	static struct etimer et;
+
+	PROCESS_BEGIN();
+
+	etimer_set(&et, evaluation_period);
+
+	while (true)
+	{
+		PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
+
+		if (has_program)
+		{
+			evaluate_program();
+		}
+
+		etimer_reset(&et);
+	}
+
+	PROCESS_END();
+}
+
+void predicate_service_start(clock_time_t period, predicate_service_failure_t failure)
+{
+	evaluation_period = period;
+	failure_fn = failure;
+
+	broadcast_open(&bc, 140, &bc_callbacks);
+	runicast_open(&rc, 142, &rc_callbacks);
+
+	manifest_interval = MANIFEST_MAX;
+
+	// Carry on with the program we had before a reboot
+	uint8_t version;
+	uint16_t length;
+	uint16_t crc;
+
+	if (program_cache_get_active(&version, &length, &crc) &&
+		length <= PREDICATE_PROGRAM_MAX &&
+		program_cache_load(fetch_buffer, length, crc))
+	{
+		printf("Loaded predicate program Version:%u from flash\n", version);
+		predicate_service_install(fetch_buffer, length, version);
+	}
+
+	process_start(&predicate_service_process, NULL);
+}
+
+void predicate_service_stop(void)
+{
+	process_exit(&predicate_service_process);
+
+	stop_fetch();
+	ctimer_stop(&manifest_ct);
+
+	runicast_close(&rc);
+	broadcast_close(&bc);
+}
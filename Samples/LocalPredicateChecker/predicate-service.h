@@ -0,0 +1,27 @@
+#ifndef CS407_PREDICATE_SERVICE_H
+#define CS407_PREDICATE_SERVICE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "contiki.h"
+
+// The largest predicate program that can be received
+#define PREDICATE_PROGRAM_MAX 256
+
+// Called when the installed program evaluates to false
+typedef void (*predicate_service_failure_t)(uint8_t version);
+
+/** Start taking part in spreading predicate programs around the
+	network, and evaluating the newest program that arrives every
+	period. */
+void predicate_service_start(clock_time_t period, predicate_service_failure_t failure);
+
+void predicate_service_stop(void);
+
+/** Install a program on this node, such as one compiled by Dragon that
+	is given to the sink. It spreads to every node running the service
+	that has an older version. */
+bool predicate_service_install(uint8_t const * program, uint16_t length, uint8_t version);
+
+#endif /*CS407_PREDICATE_SERVICE_H*/
@@ -0,0 +1,198 @@
+#include "program-cache.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "cfs/cfs.h"
+#include "cfs/cfs-coffee.h"
+#include "lib/crc16.h"
+
+// The index of the cached programs and the active program
+static const char * INDEX_NAME = "pcache";
+
+typedef struct
+{
+	uint16_t length;
+	uint16_t crc;
+} program_key_t;
+
+typedef struct
+{
+	// Most recently stored first
+	program_key_t programs[PROGRAM_CACHE_SIZE];
+	uint8_t count;
+
+	bool has_active;
+	uint8_t active_version;
+	program_key_t active;
+
+} program_index_t;
+
+/** Each program is stored in its own file named after its key */
+static void program_name(char * name, size_t size, program_key_t const * key)
+{
+	snprintf(name, size, "p%04x%04x", key->crc, key->length);
+}
+
+static void read_index(program_index_t * index)
+{
+	memset(index, 0, sizeof(program_index_t));
+
+	int fd = cfs_open(INDEX_NAME, CFS_READ);
+
+	if (fd >= 0)
+	{
+		if (cfs_read(fd, index, sizeof(program_index_t)) != sizeof(program_index_t))
+		{
+			memset(index, 0, sizeof(program_index_t));
+		}
+
+		cfs_close(fd);
+	}
+}
+
+static bool write_index(program_index_t const * index)
+{
+	cfs_remove(INDEX_NAME);
+
+	int fd = cfs_open(INDEX_NAME, CFS_WRITE);
+
+	if (fd < 0)
+	{
+		printf("Failed to open the program cache index\n");
+		return false;
+	}
+
+	bool written = cfs_write(fd, index, sizeof(program_index_t)) == sizeof(program_index_t);
+
+	cfs_close(fd);
+
+	return written;
+}
+
+static uint8_t find_program(program_index_t const * index, program_key_t const * key)
+{
+	uint8_t i;
+	for (i = 0; i != index->count; ++i)
+	{
+		if (index->programs[i].crc == key->crc && index->programs[i].length == key->length)
+		{
+			break;
+		}
+	}
+
+	return i;
+}
+
+bool program_cache_store(uint8_t const * program, uint16_t length, uint16_t crc)
+{
+	program_key_t const key = { length, crc };
+	char name[10];
+
+	program_index_t index;
+	read_index(&index);
+
+	uint8_t i = find_program(&index, &key);
+
+	if (i == index.count)
+	{
+		// Remove the least recently stored program to make space
+		if (index.count == PROGRAM_CACHE_SIZE)
+		{
+			--i;
+			program_name(name, sizeof(name), &index.programs[i]);
+			cfs_remove(name);
+		}
+		else
+		{
+			index.count++;
+		}
+
+		program_name(name, sizeof(name), &key);
+		cfs_remove(name);
+		cfs_coffee_reserve(name, length);
+
+		int fd = cfs_open(name, CFS_WRITE);
+
+		if (fd < 0 || cfs_write(fd, program, length) != length)
+		{
+			printf("Failed to store predicate program %s\n", name);
+
+			if (fd >= 0)
+			{
+				cfs_close(fd);
+			}
+
+			cfs_remove(name);
+			return false;
+		}
+
+		cfs_close(fd);
+	}
+
+	// Move the program to the front
+	memmove(&index.programs[1], &index.programs[0], i * sizeof(program_key_t));
+	index.programs[0] = key;
+
+	return write_index(&index);
+}
+
+bool program_cache_load(uint8_t * program, uint16_t length, uint16_t crc)
+{
+	program_key_t const key = { length, crc };
+	char name[10];
+
+	program_index_t index;
+	read_index(&index);
+
+	if (find_program(&index, &key) == index.count)
+	{
+		return false;
+	}
+
+	program_name(name, sizeof(name), &key);
+
+	int fd = cfs_open(name, CFS_READ);
+
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	bool loaded = cfs_read(fd, program, length) == length;
+
+	cfs_close(fd);
+
+	// Make sure flash has not given us something else
+	return loaded && crc16_data(program, length, 0) == crc;
+}
+
+bool program_cache_set_active(uint8_t version, uint16_t length, uint16_t crc)
+{
+	program_index_t index;
+	read_index(&index);
+
+	index.has_active = true;
+	index.active_version = version;
+	index.active.length = length;
+	index.active.crc = crc;
+
+	return write_index(&index);
+}
+
+bool program_cache_get_active(uint8_t * version, uint16_t * length, uint16_t * crc)
+{
+	program_index_t index;
+	read_index(&index);
+
+	if (!index.has_active)
+	{
+		return false;
+	}
+
+	*version = index.active_version;
+	*length = index.active.length;
+	*crc = index.active.crc;
+
+	return true;
+}
@@ -0,0 +1,24 @@
+#ifndef CS407_PROGRAM_CACHE_H
+#define CS407_PROGRAM_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The number of predicate programs kept in flash
+#define PROGRAM_CACHE_SIZE 3
+
+/** Stores a program in flash, keyed by its CRC16 and length.
+	The least recently stored program is removed when the cache is full. */
+bool program_cache_store(uint8_t const * program, uint16_t length, uint16_t crc);
+
+/** Loads the program with the given CRC16 and length from flash,
+	returns false if it is not there or it has been corrupted */
+bool program_cache_load(uint8_t * program, uint16_t length, uint16_t crc);
+
+/** Records which program was last installed, so it can be loaded at boot */
+bool program_cache_set_active(uint8_t version, uint16_t length, uint16_t crc);
+
+/** Returns false if no program has been installed */
+bool program_cache_get_active(uint8_t * version, uint16_t * length, uint16_t * crc);
+
+#endif /*CS407_PROGRAM_CACHE_H*/
@@ -15,10 +15,16 @@
 #include "net/rime.h"
 #include "net/rime/stbroadcast.h"
 #include "net/rime/unicast.h"
+#include "net/rime/runicast.h"
 #include "contiki-net.h"
 
 #include "sensor-converter.h"
+#include "sensor-mean.h"
 #include "debug-helper.h"
+#include "batch-buffer.h"
+#include "histogram.h"
+#include "top-k.h"
+#include "sensor-sampler.h"
 
 #include "tree-aggregator.h"
 
@@ -35,6 +41,12 @@ static tree_agg_conn_t * conncvt_unicast(struct unicast_conn * conn)
 		(((char *)conn) - sizeof(struct stbroadcast_conn));
 }
 
+static tree_agg_conn_t * conncvt_runicast(struct runicast_conn * conn)
+{
+	return (tree_agg_conn_t *)
+		(((char *)conn) - sizeof(struct stbroadcast_conn) - sizeof(struct unicast_conn));
+}
+
 
 
 static bool is_sink(tree_agg_conn_t * conn)
@@ -52,140 +64,910 @@ static const int MAX_RUNICAST_RETX = 5;
 static const clock_time_t STUBBORN_INTERVAL = 5 * CLOCK_SECOND;
 static const clock_time_t STUBBORN_WAIT = 30 * CLOCK_SECOND;
 
-// Time to gather aggregations over
+// The number of times an undelivered aggregate will be
+// resent before it is given up on
+static const unsigned int MAX_AGGREGATE_RETRIES = 2;
+
+// The default time to gather aggregations over
 static const clock_time_t AGGREGATION_WAIT = 20 * CLOCK_SECOND;
 
-// Time to wait to detect parents
-static const clock_time_t PARENT_DETECT_WAIT = 15 * CLOCK_SECOND;
+// Time to wait to detect parents
+static const clock_time_t PARENT_DETECT_WAIT = 15 * CLOCK_SECOND;
+
+// The worst ETX a single link is estimated to have
+static const uint16_t LINK_ETX_MAX = 5 * TREE_AGG_ETX_SCALE;
+
+// A new parent must be this much better than the current
+// one before we switch to it, this prevents flapping between
+// two parents with a similar link quality.
+static const uint16_t PARENT_SWITCH_HYSTERESIS = TREE_AGG_ETX_SCALE / 2;
+
+// The number of consecutive failed sends after which
+// we consider our parent to have died
+static const unsigned int MAX_PARENT_FAILURES = 3;
+
+// How many older epochs, each newer than the last, a child must send
+// before we decide it has rebooted rather than resent an old aggregate
+static const uint8_t CHILD_RESTART_EPOCHS = 2;
+
+// CC2420 RSSI register values (dBm + 45) that are
+// considered to be at the noise floor and a perfect link
+static const int RSSI_NOISE_FLOOR = -45;
+static const int RSSI_GOOD = -25;
+
+// CC2420 link quality values that are considered
+// to be a bad and a perfect link
+static const int LQI_BAD = 60;
+static const int LQI_GOOD = 100;
+
+
+static void stbroadcast_cancel_void(void * ptr)
+{
+	stbroadcast_cancel(&conncvt_stbcast((struct stbroadcast_conn *)ptr)->bc);
+
+	printf("Stubborn bcast canceled\n");
+}
+
+// The hop count sent in setup messages by nodes
+// that have lost their parent and are looking for a new one
+#define HOP_COUNT_DETACHED UINT_MAX
+
+typedef struct
+{
+	rimeaddr_t source;
+	rimeaddr_t parent;
+	unsigned int hop_count;
+
+	// The total ETX of the path from the source to the sink
+	uint16_t path_etx;
+
+} setup_tree_msg_t;
+
+// This header is placed in front of the user's data in
+// every aggregation message
+typedef struct
+{
+	// The epoch of this aggregate, and the epoch of the oldest
+	// unsent aggregate that has been merged into it
+	uint8_t epoch;
+	uint8_t first_epoch;
+
+} aggregation_header_t;
+
+
+// Scale a value between bad and good onto an ETX between
+// LINK_ETX_MAX and a perfect link.
+static uint16_t scale_link_etx(int value, int bad, int good)
+{
+	if (value >= good)
+	{
+		return TREE_AGG_ETX_SCALE;
+	}
+	else if (value <= bad)
+	{
+		return LINK_ETX_MAX;
+	}
+	else
+	{
+		return LINK_ETX_MAX -
+			((LINK_ETX_MAX - TREE_AGG_ETX_SCALE) * (value - bad)) / (good - bad);
+	}
+}
+
+/** Estimate the ETX of the link the current packet arrived on
+	using the RSSI and LQI that the radio recorded for it. */
+static uint16_t link_etx_from_packetbuf(void)
+{
+	int rssi = (int8_t)packetbuf_attr(PACKETBUF_ATTR_RSSI);
+	int lqi = packetbuf_attr(PACKETBUF_ATTR_LINK_QUALITY);
+
+	uint16_t rssi_etx = scale_link_etx(rssi, RSSI_NOISE_FLOOR, RSSI_GOOD);
+	uint16_t lqi_etx = scale_link_etx(lqi, LQI_BAD, LQI_GOOD);
+
+	// Trust whichever indicator is more pessimistic
+	return rssi_etx > lqi_etx ? rssi_etx : lqi_etx;
+}
+
+/** Exponentially weighted moving average of link estimates */
+static uint16_t etx_ewma(uint16_t current, uint16_t sample)
+{
+	return (current * 3 + sample) / 4;
+}
+
+/** Add two ETX values, saturating rather than overflowing */
+static uint16_t etx_add(uint16_t a, uint16_t b)
+{
+	uint32_t sum = (uint32_t)a + b;
+
+	return sum > UINT16_MAX ? UINT16_MAX : (uint16_t)sum;
+}
+
+static uint16_t neighbour_cost(tree_agg_neighbour_t const * n)
+{
+	return etx_add(n->path_etx, n->link_etx);
+}
+
+static tree_agg_neighbour_t * find_neighbour(tree_agg_conn_t * conn, rimeaddr_t const * addr)
+{
+	unsigned int i;
+	for (i = 0; i != TREE_AGG_MAX_NEIGHBOURS; ++i)
+	{
+		if (rimeaddr_cmp(&conn->neighbours[i].addr, addr) != 0)
+		{
+			return &conn->neighbours[i];
+		}
+	}
+
+	return NULL;
+}
+
+/** Record the link estimate for the sender of a setup message.
+	If the table is full the worst neighbour is evicted, provided
+	the new one is better. Returns NULL if the neighbour was not stored. */
+static tree_agg_neighbour_t * update_neighbour(tree_agg_conn_t * conn, setup_tree_msg_t const * msg)
+{
+	uint16_t sample = link_etx_from_packetbuf();
+
+	tree_agg_neighbour_t * n = find_neighbour(conn, &msg->source);
+
+	if (n != NULL)
+	{
+		n->link_etx = etx_ewma(n->link_etx, sample);
+	}
+	else
+	{
+		// Find an empty slot, or failing that the worst neighbour
+		tree_agg_neighbour_t * worst = NULL;
+
+		unsigned int i;
+		for (i = 0; i != TREE_AGG_MAX_NEIGHBOURS; ++i)
+		{
+			tree_agg_neighbour_t * current = &conn->neighbours[i];
+
+			if (rimeaddr_cmp(&current->addr, &rimeaddr_null) != 0)
+			{
+				worst = current;
+				break;
+			}
+
+			if (worst == NULL || neighbour_cost(current) > neighbour_cost(worst))
+			{
+				worst = current;
+			}
+		}
+
+		if (rimeaddr_cmp(&worst->addr, &rimeaddr_null) == 0 &&
+			neighbour_cost(worst) <= etx_add(msg->path_etx, sample))
+		{
+			return NULL;
+		}
+
+		n = worst;
+		rimeaddr_copy(&n->addr, &msg->source);
+		n->link_etx = sample;
+	}
+
+	rimeaddr_copy(&n->parent, &msg->parent);
+	n->hop_count = msg->hop_count;
+	n->path_etx = msg->path_etx;
+
+	return n;
+}
+
+/** Returns true if a is a better parent than b.
+	The ETX of the path is compared first, then the hop count. */
+static bool is_better_parent(tree_agg_neighbour_t const * a, tree_agg_neighbour_t const * b)
+{
+	uint16_t a_cost = neighbour_cost(a);
+	uint16_t b_cost = neighbour_cost(b);
+
+	return a_cost < b_cost || (a_cost == b_cost && a->hop_count < b->hop_count);
+}
+
+static tree_agg_neighbour_t * best_neighbour(tree_agg_conn_t * conn)
+{
+	tree_agg_neighbour_t * best = NULL;
+
+	unsigned int i;
+	for (i = 0; i != TREE_AGG_MAX_NEIGHBOURS; ++i)
+	{
+		tree_agg_neighbour_t * current = &conn->neighbours[i];
+
+		if (rimeaddr_cmp(&current->addr, &rimeaddr_null) == 0 &&
+			(best == NULL || is_better_parent(current, best)))
+		{
+			best = current;
+		}
+	}
+
+	return best;
+}
+
+/** Find the best neighbour to replace a failed parent with.
+	The neighbour must not be one of our children or detached itself.
+	If we are still attached it must also be closer to the sink than us,
+	so that it cannot be part of our own subtree. */
+static tree_agg_neighbour_t * best_repair_neighbour(tree_agg_conn_t * conn)
+{
+	tree_agg_neighbour_t * best = NULL;
+
+	unsigned int i;
+	for (i = 0; i != TREE_AGG_MAX_NEIGHBOURS; ++i)
+	{
+		tree_agg_neighbour_t * current = &conn->neighbours[i];
+
+		if (rimeaddr_cmp(&current->addr, &rimeaddr_null) != 0 ||
+			rimeaddr_cmp(&current->parent, &rimeaddr_node_addr) != 0 ||
+			current->hop_count == HOP_COUNT_DETACHED)
+		{
+			continue;
+		}
+
+		if (!conn->is_detached && current->hop_count > conn->best_hop)
+		{
+			continue;
+		}
+
+		if (best == NULL || is_better_parent(current, best))
+		{
+			best = current;
+		}
+	}
+
+	return best;
+}
+
+
+/** Broadcast our current position in the tree to our neighbours */
+static void send_setup(tree_agg_conn_t * conn)
+{
+	packetbuf_clear();
+	packetbuf_set_datalen(sizeof(setup_tree_msg_t));
+	debug_packet_size(sizeof(setup_tree_msg_t));
+	setup_tree_msg_t * msg = (setup_tree_msg_t *)packetbuf_dataptr();
+	memset(msg, 0, sizeof(setup_tree_msg_t));
+
+	// We set the parent of this node to be the best
+	// parent we heard
+	rimeaddr_copy(&msg->source, &rimeaddr_node_addr);
+	rimeaddr_copy(&msg->parent, &conn->best_parent);
+	msg->hop_count = conn->is_detached ? HOP_COUNT_DETACHED : conn->best_hop + 1;
+	msg->path_etx = conn->best_path_etx;
+
+	stbroadcast_send_stubborn(&conn->bc, STUBBORN_INTERVAL);
+
+	// Wait for a bit to allow a few messages to be sent
+	static struct ctimer ct;
+	ctimer_set(&ct, STUBBORN_WAIT, &stbroadcast_cancel_void, conn);
+}
+
+/** Make the given neighbour our parent */
+static void set_parent(tree_agg_conn_t * conn, tree_agg_neighbour_t const * parent)
+{
+	rimeaddr_copy(&conn->best_parent, &parent->addr);
+	conn->best_hop = parent->hop_count;
+	conn->best_path_etx = neighbour_cost(parent);
+
+	conn->is_detached = false;
+	conn->parent_failures = 0;
+}
+
+/** Called when our parent is believed to have died.
+	We try to pick a new parent from the neighbours we cached
+	during setup. If there are none we tell our neighbours we are
+	detached, so our children can repair and attached neighbours
+	can offer themselves. Only this subtree is affected. */
+static void parent_failed(tree_agg_conn_t * conn)
+{
+	printf("Parent %s has failed\n", addr2str(&conn->best_parent));
+
+	// Forget about the failed parent so we do not pick it again
+	tree_agg_neighbour_t * failed = find_neighbour(conn, &conn->best_parent);
+	if (failed != NULL)
+	{
+		memset(failed, 0, sizeof(tree_agg_neighbour_t));
+	}
+
+	tree_agg_neighbour_t const * replacement = best_repair_neighbour(conn);
+
+	if (replacement != NULL)
+	{
+		set_parent(conn, replacement);
+
+		printf("Repaired: Parent:%s Hop:%u ETX:%u\n",
+			addr2str(&conn->best_parent), conn->best_hop, conn->best_path_etx);
+	}
+	else
+	{
+		printf("No replacement parent, detached from tree\n");
+
+		rimeaddr_copy(&conn->best_parent, &rimeaddr_null);
+		conn->best_hop = UINT_MAX;
+		conn->best_path_etx = UINT16_MAX;
+		conn->is_detached = true;
+		conn->parent_failures = 0;
+
+		leds_on(LEDS_RED);
+	}
+
+	// Let our neighbours know where we are now in the tree
+	send_setup(conn);
+}
+
+static void start_aggregate_round(tree_agg_conn_t * conn);
+
+static void parent_detect_finished(void * ptr)
+{
+	tree_agg_conn_t * conn = (tree_agg_conn_t *)ptr;
+
+	// As we are no longer listening for our parent node
+	// indicate so through the LEDs
+	leds_off(LEDS_RED);
+
+	printf("Timer on %s expired\n",
+		addr2str(&rimeaddr_node_addr));
+
+	// Set the best values
+	conn->best_parent = conn->collecting_best_parent;
+	conn->best_hop = conn->collecting_best_hop;
+
+	tree_agg_neighbour_t const * parent = find_neighbour(conn, &conn->best_parent);
+	conn->best_path_etx = parent != NULL ? neighbour_cost(parent) : UINT16_MAX;
+
+	conn->is_setup_complete = true;
+
+	printf("Found: Parent:%s Hop:%u ETX:%u\n",
+		addr2str(&conn->best_parent), conn->best_hop, conn->best_path_etx);
+
+	// Send a message that is to be received by the children
+	// of this node.
+	send_setup(conn);
+
+	// Aggregate whatever our children send on our own schedule
+	start_aggregate_round(conn);
+
+	// Start the data generation process
+	(*conn->callbacks.setup_complete)(conn);
+}
+
+
+static void * child_data(tree_agg_conn_t const * conn, tree_agg_child_t const * child)
+{
+	return ((char *)conn->child_data) + (child - conn->children) * conn->data_length;
+}
+
+static bool is_child_alive(tree_agg_conn_t const * conn, tree_agg_child_t const * child)
+{
+	return rimeaddr_cmp(&child->addr, &rimeaddr_null) == 0 &&
+		clock_seconds() - child->last_heard <= conn->child_timeout;
+}
+
+/** Apply an aggregate to the one being collected this round */
+static void collect_aggregate(tree_agg_conn_t * conn, void const * data)
+{
+	if (tree_agg_is_collecting(conn))
+	{
+		(*conn->callbacks.aggregate_update)(conn->data, data);
+	}
+	else
+	{
+		// We need to copy the users data into our memory,
+		// So we can apply future aggregtions to it.
+		memcpy(conn->data, data, conn->data_length);
+
+		// We have started collection
+		conn->is_collecting = true;
+	}
+}
+
+/** Children only send when their readings change, so for those that
+	have been silent in this round use the last aggregate they sent.
+	Children that have been silent for too long are presumed dead. */
+static void merge_silent_children(tree_agg_conn_t * conn)
+{
+	unsigned int i;
+	for (i = 0; i != TREE_AGG_MAX_CHILDREN; ++i)
+	{
+		tree_agg_child_t * child = &conn->children[i];
+
+		if (conn->child_timeout != 0 && !child->contributed &&
+			child->expected != 0 && is_child_alive(conn, child))
+		{
+			printf("Reusing Agg From:%s\n", addr2str(&child->addr));
+
+			if (is_sink(conn))
+			{
+				// Pass the reading on to the user as if it had just arrived
+				packetbuf_clear();
+				packetbuf_set_datalen(conn->data_length);
+				memcpy(packetbuf_dataptr(), child_data(conn, child), conn->data_length);
+
+				(*conn->callbacks.recv)(conn, &child->addr);
+			}
+			else
+			{
+				collect_aggregate(conn, child_data(conn, child));
+			}
+		}
+
+		child->contributed = false;
+	}
+}
+
+/** Called at the end of every aggregation round. Rounds are run from
+	our own timer rather than started by a child's aggregate, so the
+	aggregates of silent children are still forwarded when none send. */
+static void finish_aggregate_collect(void * ptr)
+{
+	tree_agg_conn_t * conn = (tree_agg_conn_t *)ptr;
+
+	start_aggregate_round(conn);
+
+	// Leaves send their own readings, so have nothing to aggregate
+	if (!is_sink(conn) && tree_agg_is_leaf(conn))
+	{
+		return;
+	}
+
+	merge_silent_children(conn);
+
+	if (is_sink(conn))
+	{
+		return;
+	}
+
+	(*conn->callbacks.aggregate_own)(conn->data);
+
+	packetbuf_clear();
+	packetbuf_set_datalen(conn->data_length);
+	debug_packet_size(conn->data_length);
+
+	// Copy aggregation data into the packet
+	memcpy(packetbuf_dataptr(), conn->data, conn->data_length);
+
+	tree_agg_send(conn);
+
+	// We are no longer collecting aggregation data
+	conn->is_collecting = false;
+
+	// Reset the data we have stored to nothing
+	memset(conn->data, 0, conn->data_length);
+}
+
+static void start_aggregate_round(tree_agg_conn_t * conn)
+{
+	static struct ctimer aggregate_ct;
+	ctimer_set(&aggregate_ct, conn->round_period, &finish_aggregate_collect, conn);
+}
+
+static tree_agg_child_t * find_child(tree_agg_conn_t * conn, rimeaddr_t const * addr)
+{
+	tree_agg_child_t * empty = NULL;
+
+	unsigned int i;
+	for (i = 0; i != TREE_AGG_MAX_CHILDREN; ++i)
+	{
+		tree_agg_child_t * current = &conn->children[i];
+
+		if (rimeaddr_cmp(&current->addr, addr) != 0)
+		{
+			return current;
+		}
+
+		if (empty == NULL && rimeaddr_cmp(&current->addr, &rimeaddr_null) != 0)
+		{
+			empty = current;
+		}
+	}
+
+	// If the table is full replace a child that has died
+	if (empty == NULL && conn->child_timeout != 0)
+	{
+		for (i = 0; i != TREE_AGG_MAX_CHILDREN; ++i)
+		{
+			if (!is_child_alive(conn, &conn->children[i]))
+			{
+				empty = &conn->children[i];
+				break;
+			}
+		}
+	}
+
+	// This is a new child, so start tracking it if there is space
+	if (empty != NULL)
+	{
+		rimeaddr_copy(&empty->addr, addr);
+		empty->received = 0;
+		empty->expected = 0;
+		empty->backward_count = 0;
+		empty->contributed = false;
+	}
+
+	return empty;
+}
+
+/** Whether a child's epochs have gone back to the start. This is taken
+	to be the case when it has been silent past the child timeout, or
+	when older epochs keep arriving and counting up from each other. */
+static bool has_child_restarted(tree_agg_conn_t const * conn,
+                                tree_agg_child_t * child, uint8_t epoch)
+{
+	if (conn->child_timeout != 0 && !is_child_alive(conn, child))
+	{
+		return true;
+	}
+
+	uint8_t gap = (uint8_t)(epoch - child->backward_epoch);
+
+	if (child->backward_count != 0 && gap != 0 && gap <= UINT8_MAX / 2)
+	{
+		++child->backward_count;
+	}
+	else
+	{
+		child->backward_count = 1;
+	}
+
+	child->backward_epoch = epoch;
+
+	return child->backward_count >= CHILD_RESTART_EPOCHS;
+}
+
+/** Record that an aggregate has been received from a child.
+	Returns false if it is a duplicate of one already received. */
+static bool record_child_epoch(tree_agg_conn_t const * conn,
+                               tree_agg_child_t * child, aggregation_header_t const * header)
+{
+	// We have run out of space to track this child,
+	// so just accept everything from it
+	if (child == NULL)
+	{
+		return true;
+	}
+
+	// The number of epochs this aggregate covers
+	uint8_t covered = (uint8_t)(header->epoch - header->first_epoch) + 1;
+
+	uint8_t gap = (uint8_t)(header->epoch - child->last_epoch);
+
+	if (child->expected == 0)
+	{
+		// First aggregate from this child
+		child->received = 1;
+		child->expected = 1;
+	}
+	else if (gap != 0 && gap <= UINT8_MAX / 2)
+	{
+		child->received += covered < gap ? covered : gap;
+		child->expected += gap;
+	}
+	else if (gap != 0 && has_child_restarted(conn, child, header->epoch))
+	{
+		// Start counting again from the child's new epochs
+		printf("Child %s restarted its epochs at E:%u\n",
+			addr2str(&child->addr), header->epoch);
+
+		++child->received;
+		++child->expected;
+	}
+	else
+	{
+		// Epochs that are the same or older are duplicates
+		return false;
+	}
+
+	child->backward_count = 0;
+
+	child->last_epoch = header->epoch;
+	child->last_heard = clock_seconds();
+
+	return true;
+}
+
+static void print_delivery_ratio(tree_agg_conn_t const * conn)
+{
+	unsigned int received = 0;
+	unsigned int expected = 0;
+
+	unsigned int i;
+	for (i = 0; i != TREE_AGG_MAX_CHILDREN; ++i)
+	{
+		received += conn->children[i].received;
+		expected += conn->children[i].expected;
+	}
+
+	printf("Delivery ratio: %u/%u\n", received, expected);
+
+	// Children that are silent only send heartbeats, so
+	// not hearing even those means they have died.
+	if (conn->child_timeout != 0)
+	{
+		for (i = 0; i != TREE_AGG_MAX_CHILDREN; ++i)
+		{
+			tree_agg_child_t const * child = &conn->children[i];
+
+			if (child->expected != 0 && !is_child_alive(conn, child))
+			{
+				printf("Child %s presumed dead, silent for %lus\n",
+					addr2str(&child->addr), clock_seconds() - child->last_heard);
+			}
+		}
+	}
+}
+
+/** Apply a single aggregate received from a child */
+static void aggregate_record(tree_agg_conn_t * conn, tree_agg_child_t * child,
+                             rimeaddr_t const * originator, void const * msg)
+{
+	// Remember what this child sent in case it goes silent
+	if (child != NULL)
+	{
+		memcpy(child_data(conn, child), msg, conn->data_length);
+		child->contributed = true;
+	}
+
+	if (is_sink(conn))
+	{
+		// Pass this messge up to the user
+		(*conn->callbacks.recv)(conn, originator);
+	}
+	else
+	{
+		// Apply some aggregation function, the result
+		// is sent at the end of the current round
+		printf("%s Agg With:%s\n",
+			tree_agg_is_collecting(conn) ? "Cont" : "Star",
+			addr2str(originator));
+
+		collect_aggregate(conn, msg);
+	}
+}
+
+static void recv_aggregate(tree_agg_conn_t * conn, rimeaddr_t const * originator)
+{
+	aggregation_header_t header;
+	memcpy(&header, packetbuf_dataptr(), sizeof(aggregation_header_t));
+
+	tree_agg_child_t * child = find_child(conn, originator);
+
+	if (!record_child_epoch(conn, child, &header))
+	{
+		printf("Dup Agg From:%s E:%u\n", addr2str(originator), header.epoch);
+		return;
+	}
+
+	// Remove our header so the user only sees their data
+	packetbuf_hdrreduce(sizeof(aggregation_header_t));
+
+	// The packet may contain a batch of several aggregates,
+	// each one is handled as if it arrived on its own.
+	uint8_t count = batch_unpack_begin(conn->data_length);
+
+	uint8_t i;
+	for (i = 0; i != count; ++i)
+	{
+		aggregate_record(conn, child, originator, packetbuf_dataptr());
+
+		batch_unpack_next(conn->data_length);
+	}
+
+	if (is_sink(conn))
+	{
+		print_delivery_ratio(conn);
+	}
+}
+
+/** Put our header in front of the aggregates in the packetbuf
+	and send them to our parent */
+static void send_to_parent(tree_agg_conn_t * conn, uint8_t first_epoch, uint8_t epoch)
+{
+	if (!packetbuf_hdralloc(sizeof(aggregation_header_t)))
+	{
+		printf("No space for the aggregation header\n");
+		return;
+	}
+
+	aggregation_header_t * header = (aggregation_header_t *)packetbuf_hdrptr();
+	header->epoch = epoch;
+	header->first_epoch = first_epoch;
 
+	if (conn->is_reliable)
+	{
+		conn->is_sending = runicast_send(&conn->rc, &conn->best_parent, MAX_RUNICAST_RETX) != 0;
+	}
+	else
+	{
+		conn->is_sending = unicast_send(&conn->uc, &conn->best_parent) != 0;
+	}
+}
 
-static void stbroadcast_cancel_void(void * ptr)
+/** Send a single aggregate we have kept hold of as a batch of one */
+static void send_kept(tree_agg_conn_t * conn, void const * data, uint8_t first_epoch, uint8_t epoch)
 {
-	stbroadcast_cancel(&conncvt_stbcast((struct stbroadcast_conn *)ptr)->bc);
+	uint16_t length = 1 + conn->data_length;
 
-	printf("Stubborn bcast canceled\n");
+	packetbuf_clear();
+	packetbuf_set_datalen(length);
+	debug_packet_size(length);
+
+	uint8_t * msg = (uint8_t *)packetbuf_dataptr();
+	msg[0] = 1;
+	memcpy(msg + 1, data, conn->data_length);
+
+	send_to_parent(conn, first_epoch, epoch);
 }
 
-typedef struct
+/** Send the oldest aggregate that our parent is not known to have.
+	An undelivered aggregate is resent under its own epoch, so if only
+	the ACK was lost our parent will discard it as a duplicate. Newer
+	aggregates wait until it is delivered or given up on, they are never
+	merged into an aggregate that our parent might already have. */
+static void send_next(tree_agg_conn_t * conn)
 {
-	rimeaddr_t source;
-	rimeaddr_t parent;
-	unsigned int hop_count;
+	if (conn->is_sending)
+	{
+		return;
+	}
 
-} setup_tree_msg_t;
+	if (conn->has_pending && conn->pending_retries > MAX_AGGREGATE_RETRIES)
+	{
+		printf("Dropping undelivered aggregate E:%u\n", conn->pending_epoch);
 
+		conn->has_pending = false;
+		conn->pending_retries = 0;
+	}
 
-static void parent_detect_finished(void * ptr)
-{
-	tree_agg_conn_t * conn = (tree_agg_conn_t *)ptr;
+	if (conn->has_pending)
+	{
+		printf("Resending undelivered aggregate E:%u\n", conn->pending_epoch);
 
-	// As we are no longer listening for our parent node
-	// indicate so through the LEDs
-	leds_off(LEDS_RED);
+		send_kept(conn, conn->pending, conn->pending_first_epoch, conn->pending_epoch);
+	}
+	else if (conn->has_queued)
+	{
+		// The queued aggregate is now the one waiting to be delivered
+		memcpy(conn->pending, conn->queued, conn->data_length);
+		conn->pending_first_epoch = conn->queued_first_epoch;
+		conn->pending_epoch = conn->queued_epoch;
+		conn->has_pending = true;
 
-	printf("Timer on %s expired\n",
-		addr2str(&rimeaddr_node_addr));
+		conn->has_queued = false;
 
-	// Set the best values
-	conn->best_parent = conn->collecting_best_parent;
-	conn->best_hop = conn->collecting_best_hop;
+		printf("Sending queued aggregate E:%u\n", conn->pending_epoch);
 
-	printf("Found: Parent:%s Hop:%u\n",
-		addr2str(&conn->best_parent), conn->best_hop);
+		send_kept(conn, conn->pending, conn->pending_first_epoch, conn->pending_epoch);
+	}
+}
 
-	// Send a message that is to be received by the children
-	// of this node.
-	packetbuf_clear();
-	packetbuf_set_datalen(sizeof(setup_tree_msg_t));
-	debug_packet_size(sizeof(setup_tree_msg_t));
-	setup_tree_msg_t * msg = (setup_tree_msg_t *)packetbuf_dataptr();
-	memset(msg, 0, sizeof(setup_tree_msg_t));
+/** Called with the outcome of every send to our parent */
+static void parent_send_result(tree_agg_conn_t * conn, bool delivered, int num_tx)
+{
+	// All aggregates go to our parent, so use the number of
+	// transmissions it took to keep its link estimate up to date
+	tree_agg_neighbour_t * parent = find_neighbour(conn, &conn->best_parent);
 
-	// We set the parent of this node to be the best
-	// parent we heard
-	rimeaddr_copy(&msg->source, &rimeaddr_node_addr);
-	rimeaddr_copy(&msg->parent, &conn->best_parent);
-	msg->hop_count = conn->best_hop + 1;
+	if (parent != NULL)
+	{
+		uint16_t sample = delivered
+			? num_tx * TREE_AGG_ETX_SCALE
+			: LINK_ETX_MAX;
 
-	stbroadcast_send_stubborn(&conn->bc, STUBBORN_INTERVAL);
+		parent->link_etx = etx_ewma(parent->link_etx, sample);
+	}
 
-	// Wait for a bit to allow a few messages to be sent
-	static struct ctimer ct;
-	ctimer_set(&ct, STUBBORN_WAIT, &stbroadcast_cancel_void, conn);
+	conn->is_sending = false;
 
-	// Start the data generation process
-	(*conn->callbacks.setup_complete)(conn);
-}
+	if (delivered)
+	{
+		conn->parent_failures = 0;
+		conn->has_pending = false;
+		conn->pending_retries = 0;
 
+		// Anything that queued up behind it can go now
+		send_next(conn);
+	}
+	else
+	{
+		// Keep hold of the aggregate so it can be resent,
+		// our parent may still have received it
+		conn->pending_retries++;
 
-static void finish_aggregate_collect(void * ptr)
+		// Missed ACKs suggest our parent may have died
+		if (!conn->is_detached && ++conn->parent_failures >= MAX_PARENT_FAILURES)
+		{
+			parent_failed(conn);
+		}
+	}
+}
+
+static void recv_unicast(struct unicast_conn * ptr, rimeaddr_t const * originator)
 {
-	tree_agg_conn_t * conn = (tree_agg_conn_t *)ptr;
+	recv_aggregate(conncvt_unicast(ptr), originator);
+}
 
-	(*conn->callbacks.aggregate_own)(conn->data);
+static void unicast_sent(struct unicast_conn * ptr, int status, int num_tx)
+{
+	printf("unicast sent status:%d tx:%d\n", status, num_tx);
 
-	packetbuf_clear();
-	packetbuf_set_datalen(conn->data_length);
-	debug_packet_size(conn->data_length);
+	parent_send_result(conncvt_unicast(ptr), status == MAC_TX_OK, num_tx);
+}
 
-	// Copy aggregation data into the packet
-	memcpy(packetbuf_dataptr(), conn->data, conn->data_length);
+static void recv_runicast(struct runicast_conn * ptr, rimeaddr_t const * originator, uint8_t seqno)
+{
+	recv_aggregate(conncvt_runicast(ptr), originator);
+}
 
-	unicast_send(&conn->uc, &conn->best_parent);
+static void runicast_sent(struct runicast_conn * ptr, rimeaddr_t const * to, uint8_t retransmissions)
+{
+	printf("runicast sent to:%s rtx:%u\n", addr2str(to), retransmissions);
 
-	printf("Send Agg\n");
+	parent_send_result(conncvt_runicast(ptr), true, retransmissions + 1);
+}
 
-	// We are no longer collecting aggregation data
-	conn->is_collecting = false;
+static void runicast_timedout(struct runicast_conn * ptr, rimeaddr_t const * to, uint8_t retransmissions)
+{
+	printf("runicast timedout to:%s rtx:%u\n", addr2str(to), retransmissions);
 
-	// Reset the data we have stored to nothing
-	memset(conn->data, 0, conn->data_length);
+	parent_send_result(conncvt_runicast(ptr), false, retransmissions + 1);
 }
 
-/** The function that will be executed when a message is received */
-static void recv_aggregate(struct unicast_conn * ptr, rimeaddr_t const * originator)
+/** Handle setup messages received after our own setup has completed.
+	These are sent by neighbours that have repaired or lost their parent. */
+static void recv_setup_maintenance(tree_agg_conn_t * conn, setup_tree_msg_t const * msg)
 {
-	tree_agg_conn_t * conn = conncvt_unicast(ptr);
+	bool from_parent = rimeaddr_cmp(&msg->source, &conn->best_parent) != 0;
 
-	void const * msg = packetbuf_dataptr();
-
-	if (is_sink(conn))
+	if (from_parent && msg->hop_count == HOP_COUNT_DETACHED)
 	{
-		// Pass this messge up to the user
-		(*conn->callbacks.recv)(conn, originator);
+		// Our parent has lost its route to the sink,
+		// so we need to find a new one
+		parent_failed(conn);
 	}
-	else
+	else if (from_parent)
 	{
-		// Apply some aggregation function
-		if (tree_agg_is_collecting(conn))
-		{
-			printf("Cont Agg With:%s\n", addr2str(originator));
+		// Our parent has moved in the tree, so has our subtree.
+		// Only pass this on if our hop count has changed.
+		bool hop_changed = conn->best_hop != msg->hop_count;
 
-			(*conn->callbacks.aggregate_update)(conn->data, msg);
+		tree_agg_neighbour_t const * parent = find_neighbour(conn, &conn->best_parent);
+
+		conn->best_hop = msg->hop_count;
+		conn->best_path_etx = parent != NULL ? neighbour_cost(parent) : msg->path_etx;
+
+		if (hop_changed)
+		{
+			send_setup(conn);
 		}
-		else
+	}
+	else if (msg->hop_count == HOP_COUNT_DETACHED)
+	{
+		// A neighbour needs a new parent, if we are
+		// attached let it know where we are.
+		if (!conn->is_detached)
+		{
+			send_setup(conn);
+		}
+	}
+	else if (conn->is_detached && rimeaddr_cmp(&msg->parent, &rimeaddr_node_addr) == 0)
+	{
+		// An attached neighbour that is not our child,
+		// so we can rejoin the tree through it.
+		tree_agg_neighbour_t const * replacement = best_repair_neighbour(conn);
+
+		if (replacement != NULL)
 		{
-			printf("Star Agg Addr:%s\n", addr2str(originator));
+			set_parent(conn, replacement);
 
-			// We need to copy the users data into our memory,
-			// So we can apply future aggregtions to it.
-			memcpy(conn->data, msg, conn->data_length);
+			leds_off(LEDS_RED);
 
-			// We have started collection
-			conn->is_collecting = true;
+			printf("Rejoined: Parent:%s Hop:%u ETX:%u\n",
+				addr2str(&conn->best_parent), conn->best_hop, conn->best_path_etx);
 
-			// Start aggregation timer
-			static struct ctimer aggregate_ct;
-			ctimer_set(&aggregate_ct, AGGREGATION_WAIT, &finish_aggregate_collect, conn);
+			send_setup(conn);
 		}
 	}
 }
 
-static void unicast_sent(struct unicast_conn *c, int status, int num_tx)
-{
-	printf("unicast sent\n");
-}
-
 /** The function that will be executed when a message is received */
 static void recv_setup(struct stbroadcast_conn * ptr)
 {
@@ -220,18 +1002,34 @@ static void recv_setup(struct stbroadcast_conn * ptr)
 		printf("Not seen setup message before, so setting timer...\n");
 	}
 
-	// As we have received a message we need to record the node
-	// it came from, if it is closer to the sink.
-	if (msg->hop_count < conn->collecting_best_hop)
+	// As we have received a message we need to record the quality
+	// of the link to the node it came from.
+	update_neighbour(conn, msg);
+
+	if (conn->is_setup_complete)
+	{
+		recv_setup_maintenance(conn, msg);
+	}
+
+	// Then check if there is now a better parent to use, we only
+	// switch parents if the new one is significantly better.
+	tree_agg_neighbour_t const * best = best_neighbour(conn);
+	tree_agg_neighbour_t const * current = find_neighbour(conn, &conn->collecting_best_parent);
+
+	if (best != NULL && best != current &&
+		(current == NULL || etx_add(neighbour_cost(best), PARENT_SWITCH_HYSTERESIS) < neighbour_cost(current)))
 	{
-		printf("Updating to a better parent (%s H:%u) was:(%s H:%u)\n",
-			addr2str(&msg->source), msg->hop_count,
-			addr2str(&conn->collecting_best_parent), conn->collecting_best_hop
+		char best_str[RIMEADDR_STRING_LENGTH];
+		char current_str[RIMEADDR_STRING_LENGTH];
+
+		printf("Updating to a better parent (%s H:%u ETX:%u) was:(%s H:%u)\n",
+			addr2str_r(&best->addr, best_str, RIMEADDR_STRING_LENGTH), best->hop_count, neighbour_cost(best),
+			addr2str_r(&conn->collecting_best_parent, current_str, RIMEADDR_STRING_LENGTH), conn->collecting_best_hop
 		);
 
 		// Set the best parent, and the hop count of that node
-		rimeaddr_copy(&conn->collecting_best_parent, &msg->source);
-		conn->collecting_best_hop = msg->hop_count;
+		rimeaddr_copy(&conn->collecting_best_parent, &best->addr);
+		conn->collecting_best_hop = best->hop_count;
 	}
 
 	
@@ -253,8 +1051,71 @@ static const struct stbroadcast_callbacks callbacks_setup =
 	{ &recv_setup, &sent_stbroadcast };
 
 static const struct unicast_callbacks callbacks_aggregate =
-	{ &recv_aggregate, &unicast_sent };
+	{ &recv_unicast, &unicast_sent };
+
+static const struct runicast_callbacks callbacks_reliable_aggregate =
+	{ &recv_runicast, &runicast_sent, &runicast_timedout };
+
+
+/** Merge the records of a batch into a single aggregate */
+static void merge_records(tree_agg_conn_t * conn, void * into, uint8_t const * records, uint8_t count)
+{
+	uint8_t i;
+	for (i = 0; i != count; ++i)
+	{
+		(*conn->callbacks.aggregate_update)(into, records + i * conn->data_length);
+	}
+}
+
+/** Called when a batch of aggregates is ready to be sent to our parent */
+static void send_batch(void * ptr)
+{
+	tree_agg_conn_t * conn = (tree_agg_conn_t *)ptr;
+
+	uint8_t * records = ((uint8_t *)packetbuf_dataptr()) + 1;
+	uint8_t count = records[-1];
+
+	uint8_t epoch = conn->epoch++;
+
+	if (conn->is_sending || conn->has_pending)
+	{
+		// An earlier aggregate has still to be delivered, so this
+		// batch waits behind it. It has never been sent, so it is
+		// safe to merge with any others that are waiting.
+		if (!conn->has_queued)
+		{
+			memcpy(conn->queued, records, conn->data_length);
+			merge_records(conn, conn->queued, records + conn->data_length, count - 1);
+
+			conn->queued_first_epoch = epoch;
+			conn->has_queued = true;
+		}
+		else
+		{
+			merge_records(conn, conn->queued, records, count);
+		}
+
+		conn->queued_epoch = epoch;
+
+		printf("Queued Agg E:%u Count:%u\n", epoch, count);
+
+		send_next(conn);
+	}
+	else
+	{
+		// Keep a merged copy of the batch in case it is not delivered
+		memcpy(conn->pending, records, conn->data_length);
+		merge_records(conn, conn->pending, records + conn->data_length, count - 1);
+
+		conn->pending_first_epoch = epoch;
+		conn->pending_epoch = epoch;
+		conn->has_pending = true;
+
+		send_to_parent(conn, epoch, epoch);
 
+		printf("Send Agg E:%u Count:%u\n", epoch, count);
+	}
+}
 
 void tree_agg_setup_wait_finished(void * ptr)
 {
@@ -273,6 +1134,7 @@ void tree_agg_setup_wait_finished(void * ptr)
 	rimeaddr_copy(&msg->source, &rimeaddr_node_addr);
 	rimeaddr_copy(&msg->parent, &rimeaddr_null);
 	msg->hop_count = 0;
+	msg->path_etx = 0;
 
 	stbroadcast_send_stubborn(&conn->bc, STUBBORN_INTERVAL);
 
@@ -281,13 +1143,16 @@ void tree_agg_setup_wait_finished(void * ptr)
 	// Wait for a bit to allow a few messages to be sent
 	static struct ctimer ct;
 	ctimer_set(&ct, STUBBORN_WAIT, &stbroadcast_cancel_void, conn);
+
+	// The sink runs rounds too, so it can stand in for silent children
+	start_aggregate_round(conn);
 }
 
 
 
 bool tree_agg_open(tree_agg_conn_t * conn, rimeaddr_t const * sink,
                    uint16_t ch1, uint16_t ch2,
-                   size_t data_size,
+                   size_t data_size, bool reliable,
                    tree_agg_callbacks_t const * callbacks)
 {
 	if (conn != NULL && sink != NULL && callbacks != NULL &&
@@ -295,11 +1160,25 @@ bool tree_agg_open(tree_agg_conn_t * conn, rimeaddr_t const * sink,
 		callbacks->aggregate_update != NULL && callbacks->aggregate_own != NULL)
 	{
 		stbroadcast_open(&conn->bc, ch1, &callbacks_setup);
-		unicast_open(&conn->uc, ch2, &callbacks_aggregate);
+
+		conn->is_reliable = reliable;
+
+		if (conn->is_reliable)
+		{
+			runicast_open(&conn->rc, ch2, &callbacks_reliable_aggregate);
+		}
+		else
+		{
+			unicast_open(&conn->uc, ch2, &callbacks_aggregate);
+		}
 
 		conn->has_seen_setup = false;
+		conn->is_setup_complete = false;
 		conn->is_collecting = false;
 		conn->is_leaf_node = true;
+		conn->is_detached = false;
+
+		conn->parent_failures = 0;
 
 		rimeaddr_copy(&conn->best_parent, &rimeaddr_null);
 		rimeaddr_copy(&conn->collecting_best_parent, &rimeaddr_null);
@@ -309,16 +1188,62 @@ bool tree_agg_open(tree_agg_conn_t * conn, rimeaddr_t const * sink,
 		conn->best_hop = UINT_MAX;
 		conn->collecting_best_hop = UINT_MAX;
 
+		conn->best_path_etx = UINT16_MAX;
+
+		memset(conn->neighbours, 0, sizeof(conn->neighbours));
+		memset(conn->children, 0, sizeof(conn->children));
+
+		conn->epoch = 0;
+		conn->is_sending = false;
+		conn->has_pending = false;
+		conn->pending_epoch = 0;
+		conn->pending_first_epoch = 0;
+		conn->pending_retries = 0;
+		conn->has_queued = false;
+		conn->queued_epoch = 0;
+		conn->queued_first_epoch = 0;
+
 		conn->data = malloc(data_size);
+		conn->pending = malloc(data_size);
+		conn->queued = malloc(data_size);
+		conn->child_data = malloc(data_size * TREE_AGG_MAX_CHILDREN);
 
 		// Make sure memory allocation was successful
-		if (conn->data == NULL)
+		if (conn->data == NULL || conn->pending == NULL ||
+			conn->queued == NULL || conn->child_data == NULL)
 		{
+			free(conn->data);
+			free(conn->pending);
+			free(conn->queued);
+			free(conn->child_data);
+			conn->data = NULL;
+			conn->pending = NULL;
+			conn->queued = NULL;
+			conn->child_data = NULL;
 			return false;
 		}
 
+		conn->child_timeout = 0;
+
+		conn->round_period = AGGREGATION_WAIT;
+
 		conn->data_length = data_size;
 
+		// Space is left in each packet for the aggregation header.
+		// By default aggregates are sent as soon as they are ready.
+		if (!batch_init(&conn->batch, data_size, sizeof(aggregation_header_t), 0, &send_batch, conn))
+		{
+			free(conn->data);
+			free(conn->pending);
+			free(conn->queued);
+			free(conn->child_data);
+			conn->data = NULL;
+			conn->pending = NULL;
+			conn->queued = NULL;
+			conn->child_data = NULL;
+			return false;
+		}
+
 		memcpy(&conn->callbacks, callbacks, sizeof(tree_agg_callbacks_t));
 
 		if (is_sink(conn))
@@ -343,13 +1268,41 @@ void tree_agg_close(tree_agg_conn_t * conn)
 	if (conn != NULL)
 	{
 		stbroadcast_close(&conn->bc);
-		unicast_close(&conn->uc);
+
+		batch_clear(&conn->batch);
+
+		if (conn->is_reliable)
+		{
+			runicast_close(&conn->rc);
+		}
+		else
+		{
+			unicast_close(&conn->uc);
+		}
 
 		if (conn->data != NULL)
 		{
 			free(conn->data);
 			conn->data = NULL;
 		}
+
+		if (conn->pending != NULL)
+		{
+			free(conn->pending);
+			conn->pending = NULL;
+		}
+
+		if (conn->queued != NULL)
+		{
+			free(conn->queued);
+			conn->queued = NULL;
+		}
+
+		if (conn->child_data != NULL)
+		{
+			free(conn->child_data);
+			conn->child_data = NULL;
+		}
 	}
 }
 
@@ -357,7 +1310,42 @@ void tree_agg_send(tree_agg_conn_t * conn)
 {
 	if (conn != NULL)
 	{
-		unicast_send(&conn->uc, &conn->best_parent);
+		if (conn->is_detached)
+		{
+			printf("Detached from tree, not sending\n");
+			return;
+		}
+
+		// Aggregates are batched together and sent
+		// once the batch is full or has waited long enough
+		batch_add(&conn->batch, packetbuf_dataptr());
+	}
+}
+
+void tree_agg_set_batch_wait(tree_agg_conn_t * conn, clock_time_t wait)
+{
+	if (conn != NULL)
+	{
+		// Send anything waiting under the old setting
+		batch_flush(&conn->batch);
+
+		conn->batch.wait = wait;
+	}
+}
+
+void tree_agg_set_round_period(tree_agg_conn_t * conn, clock_time_t period)
+{
+	if (conn != NULL)
+	{
+		conn->round_period = period;
+	}
+}
+
+void tree_agg_set_child_timeout(tree_agg_conn_t * conn, unsigned long seconds)
+{
+	if (conn != NULL)
+	{
+		conn->child_timeout = seconds;
 	}
 }
 
@@ -371,17 +1359,62 @@ bool tree_agg_is_collecting(tree_agg_conn_t const * conn)
 	return conn != NULL && conn->is_collecting;
 }
 
+bool tree_agg_is_detached(tree_agg_conn_t const * conn)
+{
+	return conn != NULL && conn->is_detached;
+}
+
 /********************************************
  ********* APPLICATION BEGINS HERE **********
  *******************************************/
 
+// AGGREGATE_HISTOGRAM also aggregates a histogram of temperatures,
+// so the sink can report the median and 95th percentile.
+// The histogram makes each aggregate much larger so fewer fit in a batch.
+// Build with AGGREGATES=histogram to define it, see the README.
+
+#ifdef AGGREGATE_HISTOGRAM
+// Raw temperature of 0C, with buckets 2C wide up to 48C
+static const uint16_t HISTOGRAM_LOWER = 3960;
+static const uint16_t HISTOGRAM_WIDTH = 200;
+#endif
+
+// AGGREGATE_TOP_K also aggregates the hottest nodes and their temperatures.
+// Only the TOP_K hottest are kept at each hop.
+// Build with AGGREGATES=top-k to define it, see the README.
 
 typedef struct
 {
-	double temperature;
-	double humidity;
+	// The raw SHT11 readings averaged over
+	// all the readings in this aggregate
+	sensor_mean_t mean;
+
+#ifdef AGGREGATE_HISTOGRAM
+	// The raw temperatures of all the readings in this aggregate
+	histogram_t temperatures;
+#endif
+
+#ifdef AGGREGATE_TOP_K
+	// The nodes with the highest raw temperatures in this aggregate
+	top_k_t hottest;
+#endif
 } collect_msg_t;
 
+// Leaves only send a reading when it moves outside of a dead-band
+// around the last reading sent. Set both to 0 to send every reading.
+// 50 raw is 0.5C and 27 raw is roughly 1% relative humidity.
+static const uint16_t TEMPERATURE_DEAD_BAND = 50;
+static const uint16_t HUMIDITY_DEAD_BAND = 27;
+
+// Send a reading every this many samples even if it has not changed,
+// so parents can tell a silent child from a dead one.
+static const unsigned int HEARTBEAT_SAMPLES = 10;
+
+// How often the sensors are read, and how old a reading
+// can be when it is used in an aggregate
+static const clock_time_t SAMPLE_PERIOD = 60 * CLOCK_SECOND;
+static const unsigned long SAMPLE_MAX_AGE = 60;
+
 
 PROCESS(startup_process, "Startup");
 PROCESS(send_data_process, "Data Sender");
@@ -393,10 +1426,36 @@ static void tree_agg_recv(tree_agg_conn_t * conn, rimeaddr_t const * source)
 {
 	collect_msg_t const * msg = (collect_msg_t const *)packetbuf_dataptr();
 
-	printf("Sink rcv: Src:%s Temp:%d Hudmid:%d%%\n",
+	// Conversion is only done at the sink
+	int16_t temperature = sht11_temperature_centi(msg->mean.raw.temperature);
+	int16_t humidity = sht11_relative_humidity_compensated_centi(msg->mean.raw.humidity, temperature);
+
+	printf("Sink rcv: Src:%s Temp:%d Hudmid:%d%% Count:%u\n",
+			addr2str(source),
+			temperature / 100, humidity / 100, msg->mean.count
+	);
+
+#ifdef AGGREGATE_HISTOGRAM
+	// The error is given in raw units, at 0.01C each
+	printf("Sink rcv: Src:%s Temp Median:%d P95:%d Error:%u/100\n",
 			addr2str(source),
-			(int)msg->temperature, (int)msg->humidity
+			sht11_temperature_centi(histogram_quantile(&msg->temperatures, 50)) / 100,
+			sht11_temperature_centi(histogram_quantile(&msg->temperatures, 95)) / 100,
+			histogram_error(&msg->temperatures)
 	);
+#endif
+
+#ifdef AGGREGATE_TOP_K
+	uint8_t i;
+	for (i = 0; i != msg->hottest.count && i != TOP_K; ++i)
+	{
+		printf("Sink rcv: Src:%s Hottest:%u Node:%s Temp:%d\n",
+				addr2str(source), i + 1,
+				addr2str(&msg->hottest.entries[i].addr),
+				sht11_temperature_centi(msg->hottest.entries[i].value) / 100
+		);
+	}
+#endif
 }
 
 static void tree_agg_setup_finished(tree_agg_conn_t * conn)
@@ -412,24 +1471,44 @@ static void tree_aggregate_update(void * data, void const * to_apply)
 	collect_msg_t * our_data = (collect_msg_t *)data;
 	collect_msg_t const * data_to_apply = (collect_msg_t const *)to_apply;
 
-	our_data->temperature += data_to_apply->temperature;
-	our_data->humidity += data_to_apply->humidity;
+	if (data_to_apply->mean.count == 0)
+	{
+		return;
+	}
+
+	if (our_data->mean.count == 0)
+	{
+		memcpy(our_data, data_to_apply, sizeof(collect_msg_t));
+		return;
+	}
+
+	sensor_mean_merge(&our_data->mean, &data_to_apply->mean);
 
-	our_data->temperature /= 2.0;
-	our_data->humidity /= 2.0;
+#ifdef AGGREGATE_HISTOGRAM
+	histogram_merge(&our_data->temperatures, &data_to_apply->temperatures);
+#endif
+
+#ifdef AGGREGATE_TOP_K
+	top_k_merge(&our_data->hottest, &data_to_apply->hottest);
+#endif
 }
 
 static void tree_aggregate_own(void * ptr)
 {
 	collect_msg_t data;
 
-	SENSORS_ACTIVATE(sht11_sensor);
-	unsigned raw_temperature = sht11_sensor.value(SHT11_SENSOR_TEMP);
-	unsigned raw_humidity = sht11_sensor.value(SHT11_SENSOR_HUMIDITY);
-	SENSORS_DEACTIVATE(sht11_sensor);
+	// Use the latest scheduled reading if it is recent enough
+	sensor_mean_init(&data.mean, &sensor_sampler_get(SAMPLE_MAX_AGE)->raw);
+
+#ifdef AGGREGATE_HISTOGRAM
+	histogram_init(&data.temperatures, HISTOGRAM_LOWER, HISTOGRAM_WIDTH);
+	histogram_add(&data.temperatures, data.mean.raw.temperature);
+#endif
 
-	data.temperature = sht11_temperature(raw_temperature);
-	data.humidity = sht11_relative_humidity_compensated(raw_humidity, data.temperature);
+#ifdef AGGREGATE_TOP_K
+	top_k_init(&data.hottest);
+	top_k_add(&data.hottest, &rimeaddr_node_addr, data.mean.raw.temperature);
+#endif
 
 	tree_aggregate_update(ptr, &data);
 }
@@ -447,15 +1526,49 @@ PROCESS_THREAD(startup_process, ev, data)
 	sink.u8[0] = 1;
 	sink.u8[1] = 0;
 
-	tree_agg_open(&conn, &sink, 118, 132, sizeof(collect_msg_t), &callbacks);
+	// This fails when a reading and the aggregation header do not fit
+	// in a single frame, such as when too many AGGREGATES are enabled
+	if (!tree_agg_open(&conn, &sink, 118, 132, sizeof(collect_msg_t), true, &callbacks))
+	{
+		printf("Failed to open the aggregation tree, a reading is %u bytes\n",
+			(unsigned)sizeof(collect_msg_t));
+		PROCESS_EXIT();
+	}
+
+	// Readings are only generated every minute, so wait
+	// a while to send several in a single packet.
+	tree_agg_set_batch_wait(&conn, 5 * 60 * CLOCK_SECOND);
+
+	// Aggregate over the same period, so a child is only stood
+	// in for when it has not sent in a whole batch's time.
+	tree_agg_set_round_period(&conn, 5 * 60 * CLOCK_SECOND);
+
+	// Children heartbeat every 10 minutes and may batch for 5 more,
+	// so only presume them dead after missing a heartbeat.
+	tree_agg_set_child_timeout(&conn, 25 * 60);
+
+	sensor_sampler_start(SAMPLE_PERIOD);
 
 	PROCESS_END();
 }
 
 
+static uint16_t raw_difference(uint16_t a, uint16_t b)
+{
+	return a > b ? a - b : b - a;
+}
+
+/** Check if a reading has moved far enough from the last one sent */
+static bool is_outside_dead_band(sht11_raw_t const * raw, sht11_raw_t const * last_sent)
+{
+	return raw_difference(raw->temperature, last_sent->temperature) > TEMPERATURE_DEAD_BAND ||
+		raw_difference(raw->humidity, last_sent->humidity) > HUMIDITY_DEAD_BAND;
+}
+
 PROCESS_THREAD(send_data_process, ev, data)
 {
-	static struct etimer et;
+	static sht11_raw_t last_sent;
+	static unsigned int samples_since_sent;
 
 	PROCESS_BEGIN();
 
@@ -467,33 +1580,52 @@ PROCESS_THREAD(send_data_process, ev, data)
 	// so now we should move to aggregating data
 	// through the tree
 
-	etimer_set(&et, 60 * CLOCK_SECOND);
+	// Make sure the first reading is always sent
+	samples_since_sent = HEARTBEAT_SAMPLES;
  
 	// Only leaf nodes send these messages
 	while (tree_agg_is_leaf(&conn))
 	{
-		PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
+		// Wait for the sampler to read the sensors,
+		// the raw values are sent and converted at the sink.
+		PROCESS_WAIT_EVENT_UNTIL(ev == sensor_sampler_event);
 
-		// Read the data from the temp and humidity sensors
-		SENSORS_ACTIVATE(sht11_sensor);
-		unsigned raw_temperature = sht11_sensor.value(SHT11_SENSOR_TEMP);
-		unsigned raw_humidity = sht11_sensor.value(SHT11_SENSOR_HUMIDITY);
-		SENSORS_DEACTIVATE(sht11_sensor);
+		sht11_raw_t raw = ((sensor_reading_t const *)data)->raw;
 
+		++samples_since_sent;
 
-		// Create the data message that we are going to send
-		packetbuf_clear();
-		packetbuf_set_datalen(sizeof(collect_msg_t));
-		debug_packet_size(sizeof(collect_msg_t));
-		collect_msg_t * msg = (collect_msg_t *)packetbuf_dataptr();
-		memset(msg, 0, sizeof(collect_msg_t));
+		// Suppress readings that have not changed, our parent
+		// will reuse the last one we sent in its place.
+		if (samples_since_sent >= HEARTBEAT_SAMPLES || is_outside_dead_band(&raw, &last_sent))
+		{
+			// Create the data message that we are going to send
+			packetbuf_clear();
+			packetbuf_set_datalen(sizeof(collect_msg_t));
+			debug_packet_size(sizeof(collect_msg_t));
+			collect_msg_t * msg = (collect_msg_t *)packetbuf_dataptr();
+			memset(msg, 0, sizeof(collect_msg_t));
+
+			sensor_mean_init(&msg->mean, &raw);
+
+#ifdef AGGREGATE_HISTOGRAM
+			histogram_init(&msg->temperatures, HISTOGRAM_LOWER, HISTOGRAM_WIDTH);
+			histogram_add(&msg->temperatures, raw.temperature);
+#endif
+
+#ifdef AGGREGATE_TOP_K
+			top_k_init(&msg->hottest);
+			top_k_add(&msg->hottest, &rimeaddr_node_addr, raw.temperature);
+#endif
 
-		msg->temperature = sht11_temperature(raw_temperature);
-		msg->humidity = sht11_relative_humidity_compensated(raw_humidity, msg->temperature);
-		
-		tree_agg_send(&conn);
+			tree_agg_send(&conn);
 
-		etimer_reset(&et);
+			last_sent = raw;
+			samples_since_sent = 0;
+		}
+		else
+		{
+			printf("Suppressed unchanged reading\n");
+		}
 	}
 
 	PROCESS_END();
@@ -5,9 +5,65 @@
 #include "net/rime.h"
 #include "net/rime/stbroadcast.h"
 #include "net/rime/unicast.h"
+#include "net/rime/runicast.h"
+
+#include "batch-buffer.h"
 
 struct tree_agg_conn;
 
+// The maximum number of neighbours whose link quality
+// is tracked while looking for a parent
+#define TREE_AGG_MAX_NEIGHBOURS 8
+
+// ETX values are stored in fixed point with this scale,
+// so an ETX of 1.0 is stored as TREE_AGG_ETX_SCALE
+#define TREE_AGG_ETX_SCALE 100
+
+typedef struct
+{
+	rimeaddr_t addr;
+
+	// The parent this neighbour advertised, used to avoid
+	// picking one of our own children when repairing the tree
+	rimeaddr_t parent;
+
+	// The hop count and path ETX this neighbour advertised
+	unsigned int hop_count;
+	uint16_t path_etx;
+
+	// Our running estimate of the ETX of the link to this neighbour
+	uint16_t link_etx;
+
+} tree_agg_neighbour_t;
+
+// The maximum number of children whose aggregates are tracked
+#define TREE_AGG_MAX_CHILDREN 8
+
+typedef struct
+{
+	rimeaddr_t addr;
+
+	// The last epoch received from this child, used
+	// to suppress duplicate aggregates
+	uint8_t last_epoch;
+
+	// Older epochs received in a row, each newer than the one before.
+	// This happens when the child has restarted its epochs by rebooting.
+	uint8_t backward_epoch;
+	uint8_t backward_count;
+
+	// Counts used to work out the delivery ratio from this child
+	uint16_t received;
+	uint16_t expected;
+
+	// When we last heard from this child, in seconds
+	unsigned long last_heard;
+
+	// Whether this child has contributed to the current aggregate
+	bool contributed;
+
+} tree_agg_child_t;
+
 typedef struct
 {
 	/** The function called when a message is received at the sink.
@@ -27,11 +83,24 @@ typedef struct tree_agg_conn
 	// DO NOT CHANGE CONNECTION ORDER!!!
 	struct stbroadcast_conn bc;
 	struct unicast_conn uc;
+	struct runicast_conn rc;
+
+	// When reliable the aggregates are sent using runicast,
+	// otherwise unicast is used
+	bool is_reliable;
 
 	bool has_seen_setup;
+	bool is_setup_complete;
 	bool is_collecting;
 	bool is_leaf_node;
 
+	// Set when our parent has failed and no replacement
+	// has been found yet
+	bool is_detached;
+
+	// Number of consecutive failed sends to our parent
+	unsigned int parent_failures;
+
 	rimeaddr_t best_parent;
 	rimeaddr_t collecting_best_parent;
 
@@ -40,9 +109,52 @@ typedef struct tree_agg_conn
 	unsigned int best_hop;
 	unsigned int collecting_best_hop;
 
+	// The path ETX we advertise to our children
+	uint16_t best_path_etx;
+
+	// Link estimates of the neighbours heard during setup
+	tree_agg_neighbour_t neighbours[TREE_AGG_MAX_NEIGHBOURS];
+
 	void * data;
 	size_t data_length;
 
+	// The epoch of the next aggregate this node sends
+	uint8_t epoch;
+
+	// Set while waiting to hear if the last send was delivered
+	bool is_sending;
+
+	// A copy of the last aggregate sent, kept until it is delivered
+	// so it can be resent under the same epoch if it was not
+	void * pending;
+	bool has_pending;
+	uint8_t pending_epoch;
+	uint8_t pending_first_epoch;
+	unsigned int pending_retries;
+
+	// Aggregates that are waiting for the pending one to be
+	// delivered, merged together as none have been sent yet
+	void * queued;
+	bool has_queued;
+	uint8_t queued_epoch;
+	uint8_t queued_first_epoch;
+
+	tree_agg_child_t children[TREE_AGG_MAX_CHILDREN];
+
+	// The last aggregate received from each child, reused when
+	// a child is silent because its readings have not changed
+	void * child_data;
+
+	// How often the aggregates received are combined with our own and sent
+	clock_time_t round_period;
+
+	// How long a silent child's last aggregate is reused before
+	// the child is presumed dead, 0 disables reuse
+	unsigned long child_timeout;
+
+	// Aggregates waiting to be sent to our parent
+	batch_buffer_t batch;
+
 	tree_agg_callbacks_t callbacks;
 
 } tree_agg_conn_t;
@@ -51,15 +163,31 @@ typedef struct tree_agg_conn
 
 bool tree_agg_open(tree_agg_conn_t * conn, rimeaddr_t const * sink,
                    uint16_t ch1, uint16_t ch2,
-                   size_t data_size,
+                   size_t data_size, bool reliable,
                    tree_agg_callbacks_t const * callbacks);
 
 void tree_agg_close(tree_agg_conn_t * conn);
 
 void tree_agg_send(tree_agg_conn_t * conn);
 
+// Set how long aggregates may wait to be sent together in
+// one packet, a wait of 0 sends each aggregate immediately.
+void tree_agg_set_batch_wait(tree_agg_conn_t * conn, clock_time_t wait);
+
+// Set how often each node combines the aggregates it has received with
+// its own and sends them on. Rounds run whether or not children have
+// sent anything, so silent children are still accounted for.
+// The period must be less than about 500 seconds.
+void tree_agg_set_round_period(tree_agg_conn_t * conn, clock_time_t period);
+
+// Set how many seconds a silent child's last aggregate is used in place
+// of a new one. This should be longer than the interval children send
+// heartbeats at when their readings have not changed.
+void tree_agg_set_child_timeout(tree_agg_conn_t * conn, unsigned long seconds);
+
 bool tree_agg_is_leaf(tree_agg_conn_t const * conn);
 bool tree_agg_is_collecting(tree_agg_conn_t const * conn);
+bool tree_agg_is_detached(tree_agg_conn_t const * conn);
 
 #endif /*CS407_TREE_AGGREGATOR_H*/
 